@@ -21,6 +21,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_GLOB
+#include <glob.h>
+#endif
+#if defined(HAVE_FLOCK) || defined(HAVE_DUP2) || defined(__linux__)
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#include "image.h"
+#include "zip.h"
+#include "sio.h"
+#include "scan.h"
 
 /* Disks: .ATR file has a 16 byte header, then data:
  *
@@ -161,6 +177,9 @@ int disk_size = 720;
 #define ED_DISK_SIZE 1024
 #define DD_DISK_SIZE 720
 
+/* Most sectors in any image (ED), for tables indexed by sector number */
+#define MAX_SECTS 1040
+
 /* Specific sectors */
 #define SECTOR_VTOC 0x168 /* VTOC / free space bitmap */
 #define SECTOR_VTOC2 0x400 /* VTOC2 */
@@ -277,39 +296,21 @@ void set_density(int dd)
 
 #define VTOC2_NUM_UNUSED 122
 
-FILE *disk;
+struct image *disk;
 
 int getsect(unsigned char *buf, int sect)
 {
-        int offset;
-        size_t size;
-
         if (!sect) {
                 fprintf(stderr,"Oops, tried to read sector 0\n");
                 return -1;
         }
-        sect -= 1;
-
-        if (disk_dd) {
-                if (sect < 3) {
-                        size = SECTOR_SIZE;
-                        offset = SECTOR_SIZE * sect;
-                } else {
-                        size = DD_SECTOR_SIZE;
-                        offset = SECTOR_SIZE * 3 + DD_SECTOR_SIZE * (sect - 3);
-                }
-        } else {
-                size = SECTOR_SIZE;
-                offset = SECTOR_SIZE * sect;
-        }
-
-        if (fseek(disk, offset + 16, SEEK_SET)) {
-                fprintf(stderr,"Oops, tried to seek past end (sector %d)\n", sect + 1);
+        if (sect > disk->nsects) {
+                fprintf(stderr,"Oops, tried to read past end (sector %d)\n", sect);
                 status = 1;
                 return -1;
         }
-        if (size != fread((char *)buf, 1, size, disk)) {
-                fprintf(stderr,"Oops, read error (sector %d)\n", sect + 1);
+        if (image_read(disk, buf, sect)) {
+                fprintf(stderr,"Oops, read error (sector %d)\n", sect);
                 status = 1;
                 return -1;
         }
@@ -318,33 +319,16 @@ int getsect(unsigned char *buf, int sect)
 
 void putsect(unsigned char *buf, int sect)
 {
-        int offset;
-        size_t size;
-
         if (!sect) {
                 fprintf(stderr,"Oops, requested sector 0\n");
                 exit(-1);
         }
-        sect -= 1;
-        if (disk_dd) {
-                if (sect < 3) {
-                        size = SECTOR_SIZE;
-                        offset = SECTOR_SIZE * sect;
-                } else {
-                        size = DD_SECTOR_SIZE;
-                        offset = SECTOR_SIZE * 3 + DD_SECTOR_SIZE * (sect - 3);
-                }
-        } else {
-                size = SECTOR_SIZE;
-                offset = SECTOR_SIZE * sect;
-        }
-
-        if (fseek(disk, offset + 16, SEEK_SET)) {
-                fprintf(stderr,"Oops, seek error during write (sector %d)\n", sect + 1);
+        if (disk->rdonly) {
+                fprintf(stderr,"Oops, %s image is read only (sector %d)\n", disk->fmt->name, sect);
                 exit(-1);
         }
-        if (size != fwrite((char *)buf, 1, size, disk)) {
-                fprintf(stderr,"Oops, write error (sector %d)\n", sect + 1);
+        if (image_write(disk, buf, sect)) {
+                fprintf(stderr,"Oops, write error (sector %d)\n", sect);
                 exit(-1);
         }
 }
@@ -548,6 +532,8 @@ struct name
         int is_sys; /* Set if it's a .SYS file */
         int is_cm; /* Set if it's a .COM file */
 
+        double load_time; /* Estimated load time in ms if ls_drive is set */
+
         
 
         /* From file itself */
@@ -555,6 +541,9 @@ struct name
         int size;
 };
 
+/* Drive to estimate load times for, NULL if we're not */
+struct drive *ls_drive;
+
 /* Array of internal file names for formatting */
 struct name *names[(SECTOR_DIR_SIZE * SECTOR_SIZE) / ENTRY_SIZE];
 int name_n;
@@ -743,6 +732,30 @@ void read_file(int sector, FILE *f)
         } while(sector);
 }
 
+/* Read a file into memory: returns malloc block, or NULL on error */
+
+unsigned char *read_data(int sector, long *size)
+{
+        FILE *f;
+        unsigned char *buf;
+        if (!(f = tmpfile())) {
+                fprintf(stderr, "Couldn't create temporary file\n");
+                return 0;
+        }
+        read_file(sector, f);
+        *size = ftell(f);
+        rewind(f);
+        buf = (unsigned char *)malloc(*size + 1);
+        if (*size != (long)fread(buf, 1, *size, f)) {
+                fprintf(stderr, "Couldn't read back temporary file\n");
+                fclose(f);
+                free(buf);
+                return 0;
+        }
+        fclose(f);
+        return buf;
+}
+
 /* cat a file */
 
 void cat(char *name)
@@ -1095,6 +1108,528 @@ int do_check()
         return status;
 }
 
+/* Mark the sectors which never hold files: owner[sect] is set to "boot",
+   "vtoc", "directory" or "reserved", the rest to NULL.  owner has
+   MAX_SECTS + 1 entries. */
+
+void map_reserved(char *owner[])
+{
+        int x;
+        for (x = 0; x != MAX_SECTS + 1; ++x)
+                owner[x] = (x < disk_size ? 0 : "reserved");
+        owner[1] = owner[2] = owner[3] = "boot";
+        owner[SECTOR_VTOC] = "vtoc";
+        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x)
+                owner[x] = "directory";
+        if (disk_size == ED_DISK_SIZE) {
+                owner[720] = "reserved";
+                owner[SECTOR_VTOC2] = "vtoc";
+        }
+}
+
+/* Find which file owns each sector: like map_reserved(), but owner[sect]
+   is also set to the file name for each file's sectors.  NULL means the
+   sector is not in use.  Like check, but quiet. */
+
+void map_owners(char *owner[])
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int x;
+
+        map_reserved(owner);
+
+        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
+                int y;
+                if (getsect(buf, x))
+                        break;
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+                        if (d->flag & FLAG_IN_USE_ED) {
+                                char *filename = strdup(getname(d));
+                                int sector = (d->start_hi << 8) + d->start_lo;
+                                int count = 0;
+                                /* Stop at bad links and loops */
+                                while (sector > 0 && sector < disk_size && !owner[sector] && count++ != 2048) {
+                                        unsigned char fbuf[DD_SECTOR_SIZE];
+                                        owner[sector] = filename;
+                                        if (getsect(fbuf, sector))
+                                                break;
+                                        sector = (int)fbuf[data_next_low] + ((int)(0x3 & fbuf[data_next_high]) << 8);
+                                }
+                        }
+                }
+        }
+}
+
+/* 64-bit FNV-1a hash: fast, not cryptographic.  Start with h = FNV_INIT,
+   or the hash so far to continue it. */
+
+#define FNV_INIT 14695981039346656037ULL
+
+unsigned long long fnv_hash(unsigned long long h, unsigned char *buf, long len)
+{
+        while (len--) {
+                h ^= *buf++;
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
+/* Hash of sector contents */
+
+unsigned long long sect_hash(unsigned char *buf, int len)
+{
+        return fnv_hash(FNV_INIT, buf, len);
+}
+
+/* A patch file lists changed sectors:
+ *
+ *   "ATRPATCH"
+ *   sector size, number of sectors (2 bytes each, low byte first)
+ *
+ * Then for each changed sector:
+ *
+ *   sector number (2 bytes)
+ *   hash of original sector (8 bytes)
+ *   new contents of sector
+ *
+ * Then a sector number of 0.
+ */
+
+#define PATCH_MAGIC "ATRPATCH"
+
+void put_word(unsigned long long val, int len, FILE *f)
+{
+        while (len--) {
+                fputc((int)(val & 0xFF), f);
+                val >>= 8;
+        }
+}
+
+unsigned long long get_word(int len, FILE *f)
+{
+        unsigned long long val = 0;
+        int x;
+        for (x = 0; x != len; ++x)
+                val |= ((unsigned long long)(fgetc(f) & 0xFF) << (8 * x));
+        return val;
+}
+
+/* Compare names, either may be NULL */
+
+int same_name(char *a, char *b)
+{
+        if (a && b)
+                return !strcmp(a, b);
+        return a == b;
+}
+
+/* Print sectors which differ with another image, and write a patch */
+
+int do_diff(char *other_name, char *patch_name)
+{
+        struct image *other;
+        struct image *save;
+        char *owner[MAX_SECTS + 1];
+        char *new_owner[MAX_SECTS + 1];
+        char differs[MAX_SECTS + 1];
+        FILE *f = 0;
+        int count = 0;
+        int x;
+
+        if (!(other = image_open(other_name, 1)))
+                return -1;
+        if (other->sec_size != disk->sec_size || other->nsects != disk->nsects) {
+                fprintf(stderr, "'%s' and '%s' have different geometry\n", disk->name, other_name);
+                image_close(other);
+                return -1;
+        }
+        if (patch_name) {
+                f = fopen(patch_name, "wb");
+                if (!f) {
+                        fprintf(stderr, "Couldn't open patch file '%s'\n", patch_name);
+                        image_close(other);
+                        return -1;
+                }
+                fputs(PATCH_MAGIC, f);
+                put_word(disk->sec_size, 2, f);
+                put_word(disk->nsects, 2, f);
+        }
+
+        memset(differs, 0, sizeof(differs));
+
+        /* Annotate with owners from both images */
+        map_owners(owner);
+        save = disk;
+        disk = other;
+        map_owners(new_owner);
+        disk = save;
+
+        for (x = 1; x <= disk->nsects; ++x) {
+                unsigned char buf[DD_SECTOR_SIZE];
+                unsigned char new_buf[DD_SECTOR_SIZE];
+                int size = image_sect_size(disk, x);
+                if (getsect(buf, x) || image_read(other, new_buf, x)) {
+                        fprintf(stderr, " (comparing sector %d)\n", x);
+                        status = 1;
+                        continue;
+                }
+                if (!memcmp(buf, new_buf, size))
+                        continue;
+                differs[x] = 1;
+                ++count;
+                if (f) {
+                        /* Patch only needs the hash to check the original */
+                        put_word(x, 2, f);
+                        put_word(sect_hash(buf, size), 8, f);
+                        fwrite(new_buf, size, 1, f);
+                }
+        }
+        image_close(other);
+        if (f) {
+                put_word(0, 2, f);
+                if (fclose(f)) {
+                        fprintf(stderr, "Couldn't write patch file '%s'\n", patch_name);
+                        return -1;
+                }
+        }
+
+        /* Print runs of sectors with the same owners together */
+        for (x = 1; x <= disk->nsects; ++x) {
+                int y;
+                if (!differs[x])
+                        continue;
+                for (y = x; y + 1 <= disk->nsects && differs[y + 1] &&
+                     same_name(owner[y + 1], owner[x]) && same_name(new_owner[y + 1], new_owner[x]); ++y);
+                if (y == x)
+                        printf("  %-9d ", x);
+                else
+                        printf("  %4d-%-4d ", x, y);
+                if (new_owner[x] && owner[x] && strcmp(new_owner[x], owner[x]))
+                        printf("%s (was %s)\n", new_owner[x], owner[x]);
+                else if (new_owner[x])
+                        printf("%s\n", new_owner[x]);
+                else if (owner[x])
+                        printf("%s (now free)\n", owner[x]);
+                else
+                        printf("free\n");
+                x = y;
+        }
+        printf("%d sectors differ\n", count);
+        return status;
+}
+
+/* Apply a patch: nothing is written unless every sector to be changed has
+   the original contents (or already has the new contents) */
+
+int do_patch(char *patch_name)
+{
+        unsigned char magic[sizeof(PATCH_MAGIC) - 1];
+        unsigned char *new_data;
+        int *sects;
+        int n = 0;
+        int skipped = 0;
+        int x;
+        FILE *f = fopen(patch_name, "rb");
+
+        if (!f) {
+                fprintf(stderr, "Couldn't open patch file '%s'\n", patch_name);
+                return -1;
+        }
+        if (1 != fread(magic, sizeof(magic), 1, f) || memcmp(magic, PATCH_MAGIC, sizeof(magic))) {
+                fprintf(stderr, "'%s' is not a patch file\n", patch_name);
+                fclose(f);
+                return -1;
+        }
+        x = get_word(2, f);
+        if (x != disk->sec_size || (int)get_word(2, f) != disk->nsects) {
+                fprintf(stderr, "Patch '%s' is for a disk with different geometry\n", patch_name);
+                fclose(f);
+                return -1;
+        }
+
+        /* Read and verify everything first */
+        new_data = (unsigned char *)malloc((long)disk->nsects * DD_SECTOR_SIZE);
+        sects = (int *)malloc(sizeof(int) * disk->nsects);
+        for (;;) {
+                unsigned char buf[DD_SECTOR_SIZE];
+                unsigned char *p = new_data + (long)n * DD_SECTOR_SIZE;
+                unsigned long long h;
+                int sect = get_word(2, f);
+                int size;
+                if (feof(f)) {
+                        fprintf(stderr, "Patch '%s' is truncated\n", patch_name);
+                        goto error;
+                }
+                if (!sect)
+                        break;
+                if (sect > disk->nsects || n == disk->nsects) {
+                        fprintf(stderr, "Bad sector number %d in patch '%s'\n", sect, patch_name);
+                        goto error;
+                }
+                size = image_sect_size(disk, sect);
+                h = get_word(8, f);
+                if (1 != fread(p, size, 1, f)) {
+                        fprintf(stderr, "Patch '%s' is truncated\n", patch_name);
+                        goto error;
+                }
+                if (getsect(buf, sect)) {
+                        fprintf(stderr, " (trying to patch)\n");
+                        goto error;
+                }
+                if (!memcmp(buf, p, size)) {
+                        /* Already done */
+                        ++skipped;
+                        continue;
+                }
+                if (sect_hash(buf, size) != h) {
+                        fprintf(stderr, "Sector %d doesn't match the original in patch '%s': not patching\n", sect, patch_name);
+                        goto error;
+                }
+                sects[n++] = sect;
+        }
+        fclose(f);
+
+        for (x = 0; x != n; ++x)
+                putsect(new_data + (long)x * DD_SECTOR_SIZE, sects[x]);
+        printf("%d sectors patched", n);
+        if (skipped)
+                printf(", %d already patched", skipped);
+        printf("\n");
+        free(new_data);
+        free(sects);
+        return 0;
+
+        error:
+        fclose(f);
+        free(new_data);
+        free(sects);
+        return -1;
+}
+
+/* A file being moved by defrag */
+
+struct chain {
+        int file_no; /* Directory entry */
+        int n; /* Number of sectors */
+        unsigned char *data; /* Sector contents, DD_SECTOR_SIZE apart */
+        int *sects; /* Old locations, then new locations */
+};
+
+/* Read a file's sector chain for defrag.  Returns -1 if the chain is
+   damaged in any way check would complain about. */
+
+int read_chain(struct chain *c, struct dirent *d, char *owner[], char *used)
+{
+        int sector = (d->start_hi << 8) + d->start_lo;
+        int sects = (d->count_hi << 8) + d->count_lo;
+        c->n = 0;
+        c->data = (unsigned char *)malloc((long)DD_SECTOR_SIZE * disk_size);
+        c->sects = (int *)malloc(sizeof(int) * disk_size);
+        do {
+                unsigned char *buf = c->data + (long)c->n * DD_SECTOR_SIZE;
+                if (sector < 1 || sector >= disk_size || owner[sector] || used[sector])
+                        return -1;
+                used[sector] = 1;
+                if (getsect(buf, sector))
+                        return -1;
+                if (((buf[data_file_num] >> 2) & 0x3F) != c->file_no)
+                        return -1;
+                c->sects[c->n++] = sector;
+                sector = (int)buf[data_next_low] + ((int)(0x3 & buf[data_next_high]) << 8);
+        } while (sector);
+        return c->n == sects ? 0 : -1;
+}
+
+/* Directory entry of a chain in dir[][] */
+#define CHAIN_DIRENT(c) ((struct dirent *)(dir[(c)->file_no / (SECTOR_SIZE / ENTRY_SIZE)] + ENTRY_SIZE * ((c)->file_no % (SECTOR_SIZE / ENTRY_SIZE))))
+
+/* Pick sectors for a file so that it loads as fast as possible on drive:
+   for each sector in turn take the free one which the drive gets to first
+   after reading the previous one. */
+
+void place_chain(struct chain *c, char *taken, struct drive *drive)
+{
+        struct sio_sim sim[1];
+        int z;
+        sio_init(sim, drive, disk->sec_size, disk->nsects, NULL);
+        /* DOS reads the directory first */
+        sio_read(sim, SECTOR_DIR);
+        for (z = 0; z != c->n; ++z) {
+                struct sio_sim best_sim[1];
+                int best = 0;
+                int y;
+                for (y = 1; y != disk_size; ++y) {
+                        struct sio_sim try[1];
+                        if (taken[y])
+                                continue;
+                        *try = *sim;
+                        sio_read(try, y);
+                        if (!best || try->t < best_sim->t) {
+                                best = y;
+                                *best_sim = *try;
+                        }
+                }
+                c->sects[z] = best;
+                taken[best] = 1;
+                *sim = *best_sim;
+        }
+}
+
+/* Rewrite files so each one is in consecutive sectors.  Files named in
+   argv come first, in the order given, then the rest in directory order.
+   If drive is given, the named files are placed to load fastest on it
+   instead.  Everything is read into memory before anything is written.
+   Sectors the VTOC has in use but no file owns are left where they are. */
+
+int do_defrag(int argc, char *argv[], int x, struct drive *drive)
+{
+        unsigned char dir[SECTOR_DIR_SIZE][DD_SECTOR_SIZE];
+        unsigned char bitmap[ED_BITMAP_SIZE];
+        struct chain chains[SECTOR_DIR_SIZE * SECTOR_SIZE / ENTRY_SIZE];
+        struct chain *order[SECTOR_DIR_SIZE * SECTOR_SIZE / ENTRY_SIZE];
+        char *owner[MAX_SECTS + 1];
+        char used[MAX_SECTS + 1];
+        char taken[MAX_SECTS + 1];
+        char kept[MAX_SECTS + 1]; /* In use in VTOC, but not by a file */
+        int nchains = 0;
+        int norder = 0;
+        int nprio;
+        int moved = 0;
+        int total = 0;
+        int next_free = 4;
+        int y, z;
+
+        /* Files can use any sector without an owner here */
+        map_reserved(owner);
+        memset(used, 0, sizeof(used));
+
+        /* Read directory and every file */
+        for (y = 0; y != SECTOR_DIR_SIZE; ++y) {
+                if (getsect(dir[y], SECTOR_DIR + y)) {
+                        fprintf(stderr, " (trying to read directory)\n");
+                        return -1;
+                }
+                for (z = 0; z != SECTOR_SIZE; z += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(dir[y] + z);
+                        struct chain *c = chains + nchains;
+                        if (!(d->flag & FLAG_IN_USE_ED))
+                                continue;
+                        c->file_no = y * (SECTOR_SIZE / ENTRY_SIZE) + z / ENTRY_SIZE;
+                        ++nchains;
+                        /* put writes empty files without any sectors */
+                        if (!d->start_lo && !d->start_hi && !d->count_lo && !d->count_hi) {
+                                c->n = 0;
+                                c->data = 0;
+                                c->sects = 0;
+                                continue;
+                        }
+                        if (read_chain(c, d, owner, used)) {
+                                fprintf(stderr, "File '%s' has a damaged sector chain: run fix first\n", getname(d));
+                                return -1;
+                        }
+                }
+        }
+
+        /* Priority files first */
+        for (; x != argc; ++x) {
+                for (y = 0; y != nchains; ++y) {
+                        struct chain *c = chains + y;
+                        struct dirent *d = CHAIN_DIRENT(c);
+                        if (!strcmp(getname(d), argv[x]))
+                                break;
+                }
+                if (y == nchains) {
+                        fprintf(stderr, "File '%s' not found\n", argv[x]);
+                        return -1;
+                }
+                for (z = 0; z != norder; ++z)
+                        if (order[z] == chains + y)
+                                break;
+                if (z == norder)
+                        order[norder++] = chains + y;
+        }
+        nprio = norder;
+        for (y = 0; y != nchains; ++y) {
+                for (z = 0; z != norder; ++z)
+                        if (order[z] == chains + y)
+                                break;
+                if (z == norder)
+                        order[norder++] = chains + y;
+        }
+
+        /* Assign new sectors */
+        getmap(bitmap, 0);
+        for (y = 0; y != MAX_SECTS + 1; ++y) {
+                kept[y] = (y < disk_size && !owner[y] && !used[y] && !(bitmap[y >> 3] & (1 << (7 - (y & 7)))));
+                taken[y] = (owner[y] != 0 || kept[y]);
+        }
+        for (y = 0; y != norder; ++y) {
+                struct chain *c = order[y];
+                int *old;
+                if (!c->n)
+                        continue;
+                old = (int *)malloc(sizeof(int) * c->n);
+                memcpy(old, c->sects, sizeof(int) * c->n);
+                if (drive && y < nprio) {
+                        double before = sio_load_time(drive, disk->sec_size, disk->nsects, NULL, SECTOR_DIR, c->sects, c->n);
+                        place_chain(c, taken, drive);
+                        printf("%-12s %6.2fs -> %6.2fs\n", getname(CHAIN_DIRENT(c)), before / 1000.0,
+                               sio_load_time(drive, disk->sec_size, disk->nsects, NULL, SECTOR_DIR, c->sects, c->n) / 1000.0);
+                } else {
+                        for (z = 0; z != c->n; ++z) {
+                                while (taken[next_free])
+                                        ++next_free;
+                                c->sects[z] = next_free;
+                                taken[next_free] = 1;
+                        }
+                }
+                for (z = 0; z != c->n; ++z)
+                        if (old[z] != c->sects[z])
+                                ++moved;
+                total += c->n;
+                free(old);
+        }
+
+        /* Write files with new links */
+        for (y = 0; y != norder; ++y) {
+                struct chain *c = order[y];
+                struct dirent *d = CHAIN_DIRENT(c);
+                if (!c->n)
+                        continue;
+                for (z = 0; z != c->n; ++z) {
+                        unsigned char *buf = c->data + (long)z * DD_SECTOR_SIZE;
+                        int next = (z + 1 == c->n ? 0 : c->sects[z + 1]);
+                        buf[data_next_low] = next;
+                        buf[data_next_high] = (buf[data_next_high] & 0xFC) | (0x3 & (next >> 8));
+                        putsect(buf, c->sects[z]);
+                }
+                d->start_lo = c->sects[0];
+                d->start_hi = (c->sects[0] >> 8);
+                /* DOS 2.5 marks files which use sectors past 719 */
+                if (disk_size == ED_DISK_SIZE) {
+                        int ed_file = 0;
+                        for (z = 0; z != c->n; ++z)
+                                if (c->sects[z] >= 720)
+                                        ed_file = 1;
+                        d->flag = (d->flag & ~FLAG_IN_USE_ED) | (ed_file ? FLAG_OPENED : FLAG_IN_USE);
+                }
+                free(c->data);
+                free(c->sects);
+        }
+        for (y = 0; y != SECTOR_DIR_SIZE; ++y)
+                putsect(dir[y], SECTOR_DIR + y);
+
+        /* Update allocation bitmap: only sectors files moved from or to */
+        for (y = 1; y != disk_size; ++y)
+                if (!owner[y] && !kept[y] && (used[y] || taken[y]))
+                        mark_space(bitmap, y, taken[y]);
+        putmap(bitmap);
+
+        printf("%d files, %d sectors, %d sectors moved\n", nchains, total, moved);
+        return 0;
+}
+
 /* Allocate space for file */
 
 int alloc_space(unsigned char *bitmap, int *list, int sects)
@@ -1185,76 +1720,176 @@ int write_dir(int file_no, char *name, int first_sect, int sects)
         return 0;
 }
 
-/* Put a file on the disk */
+/* Read local file into memory: returns malloc block, or NULL on error */
 
-int put_file(char *local_name, char *atari_name)
+unsigned char *read_local(char *local_name, long *size)
 {
-        FILE *f = fopen(local_name, "r");
-        long size;
-        long up;
-        long x;
+        FILE *f = fopen(local_name, "rb");
         unsigned char *buf;
-        unsigned char bitmap[ED_BITMAP_SIZE];
-        int first_sect;
-        int file_no;
-        int num_sects;
         if (!f) {
                 fprintf(stderr, "Couldn't open '%s'\n", local_name);
-                return -1;
+                return 0;
         }
-        if (fseek(f, 0, SEEK_END)) {
+        if (fseek(f, 0, SEEK_END) || (*size = ftell(f)) < 0) {
                 fprintf(stderr,"Couldn't get file size of '%s'\n", local_name);
-                status = 1;
-                fclose(f);
-                return -1;
-        }
-        size = ftell(f);
-        if (size < 0)  {
-                fprintf(stderr, "Couldn't get file size of '%s'\n", local_name);
-                status = 1;
                 fclose(f);
-                return -1;
+                return 0;
         }
         rewind(f);
-        // Round up to a multiple of (DATA_SIZE)
-        up = size + (data_size) - 1;
-        up -= up % (data_size);
-        num_sects = up / data_size;
-        buf = (unsigned char *)malloc(up);
-        if (size != fread(buf, 1, size, f)) {
+        buf = (unsigned char *)malloc(*size + 1);
+        if (*size != (long)fread(buf, 1, *size, f)) {
                 fprintf(stderr, "Couldn't read file '%s'\n", local_name);
-                status = 1;
                 fclose(f);
                 free(buf);
-                return -1;
+                return 0;
         }
         fclose(f);
+        return buf;
+}
 
-        if (cvt_ending) {
-                /* Convert UNIX line endings to Atari */
-                for (x = 0; x != size; ++x)
-                        if (buf[x] == '\n')
-                                buf[x] = 0x9b;
-        }
-
-        /* Fill with NULs to end of sector */
-        for (x = size; x != up; ++x)
-                buf[x] = 0;
+/* Overwrite an existing file in place: its sectors are reused in order,
+   the chain is extended or cut only at the end, and only sectors which
+   change are written.  Returns 0 if done, 1 if it can't be done this way
+   (no such file, or its chain is damaged), -1 on error. */
 
-        /* Delete existing file */
-        rm(atari_name, 1);
+int overwrite_data(unsigned char *data, long size, char *atari_name)
+{
+        unsigned char dir_buf[DD_SECTOR_SIZE];
+        unsigned char bitmap[ED_BITMAP_SIZE];
+        char *owner[MAX_SECTS + 1];
+        char used[MAX_SECTS + 1];
+        struct chain c[1];
+        struct dirent *d = 0;
+        int dir_sect;
+        int num_sects;
+        int list[MAX_SECTS];
+        int ed_file = 0;
+        int x, y;
 
-        /* Get bitmap... */
-        getmap(bitmap, 0);
+        num_sects = (size + data_size - 1) / data_size;
+        if (!num_sects)
+                return 1;
 
-        /* Prepare directory entry */
-        file_no = find_empty_entry();
+        /* Find directory entry */
+        for (dir_sect = SECTOR_DIR; !d && dir_sect != SECTOR_DIR + SECTOR_DIR_SIZE; ++dir_sect) {
+                if (getsect(dir_buf, dir_sect))
+                        return -1;
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *e = (struct dirent *)(dir_buf + y);
+                        if (!(e->flag & (FLAG_IN_USE_ED | FLAG_DELETED)))
+                                return 1;
+                        if ((e->flag & FLAG_IN_USE_ED) && same_name(getname(e), atari_name)) {
+                                d = e;
+                                c->file_no = (dir_sect - SECTOR_DIR) * (SECTOR_SIZE / ENTRY_SIZE) + y / ENTRY_SIZE;
+                                break;
+                        }
+                }
+        }
+        if (!d)
+                return 1;
+        --dir_sect;
+
+        /* Old chain */
+        map_reserved(owner);
+        memset(used, 0, sizeof(used));
+        if (read_chain(c, d, owner, used)) {
+                free(c->data);
+                free(c->sects);
+                return 1;
+        }
+
+        /* Keep sectors in order, get more or free the extra ones at the end */
+        getmap(bitmap, 0);
+        for (x = 0; x != num_sects && x != c->n; ++x)
+                list[x] = c->sects[x];
+        if (num_sects > c->n) {
+                if (alloc_space(bitmap, list + c->n, num_sects - c->n) == -1) {
+                        free(c->data);
+                        free(c->sects);
+                        return -1;
+                }
+        } else {
+                for (x = num_sects; x != c->n; ++x)
+                        mark_space(bitmap, c->sects[x], 0);
+        }
+
+        /* Write sectors which changed */
+        for (x = 0; x != num_sects; ++x) {
+                unsigned char bf[DD_SECTOR_SIZE];
+                int bytes = (x + 1 == num_sects ? size - (long)data_size * x : data_size);
+                memset(bf, 0, sizeof(bf));
+                memcpy(bf, data + (long)data_size * x, bytes);
+                if (x + 1 == num_sects) {
+                        // Last sector
+                        bf[data_next_low] = 0;
+                        bf[data_next_high] = 0;
+                } else {
+                        bf[data_next_low] = list[x + 1];
+                        bf[data_next_high] = (list[x + 1] >> 8);
+                }
+                bf[data_bytes] = bytes;
+                bf[data_file_num] |= (c->file_no << 2);
+                if (list[x] >= 720)
+                        ed_file = 1;
+                if (x >= c->n || memcmp(bf, c->data + (long)x * DD_SECTOR_SIZE, sector_size))
+                        putsect(bf, list[x]);
+        }
+        free(c->data);
+        free(c->sects);
+
+        /* Update directory entry: same as write_dir() would make it */
+        if (num_sects != c->n || d->flag != ((ed_file ? FLAG_OPENED : FLAG_IN_USE) | FLAG_DOS2)) {
+                d->count_hi = (num_sects >> 8);
+                d->count_lo = num_sects;
+                d->flag = (ed_file ? FLAG_OPENED : FLAG_IN_USE) | FLAG_DOS2;
+                putsect(dir_buf, dir_sect);
+        }
+        if (num_sects != c->n)
+                putmap(bitmap);
+        return status;
+}
+
+/* Write data to the disk as atari_name, replacing any existing file.  An
+   existing file is overwritten in place if it can be. */
+
+int put_data(unsigned char *data, long size, char *atari_name)
+{
+        long up;
+        unsigned char *buf;
+        unsigned char bitmap[ED_BITMAP_SIZE];
+        int first_sect;
+        int file_no;
+        int num_sects;
+        int rtn;
+
+        if ((rtn = overwrite_data(data, size, atari_name)) != 1)
+                return rtn;
+
+        // Round up to a multiple of (DATA_SIZE)
+        up = size + (data_size) - 1;
+        up -= up % (data_size);
+        num_sects = up / data_size;
+
+        /* Fill with NULs to end of sector */
+        buf = (unsigned char *)calloc(up + 1, 1);
+        memcpy(buf, data, size);
+
+        /* Delete existing file */
+        rm(atari_name, 1);
+
+        /* Get bitmap... */
+        getmap(bitmap, 0);
+
+        /* Prepare directory entry */
+        file_no = find_empty_entry();
         if (file_no == -1) {
+                free(buf);
                 return -1;
         }
 
         /* Allocate space and write file */
         first_sect = write_file(bitmap, buf, num_sects, file_no, size);
+        free(buf);
 
         if (first_sect == -1) {
                 fprintf(stderr, "Couldn't write file\n");
@@ -1273,6 +1908,32 @@ int put_file(char *local_name, char *atari_name)
         return status;
 }
 
+/* Put a file on the disk */
+
+int put_file(char *local_name, char *atari_name)
+{
+        long size;
+        long x;
+        unsigned char *buf;
+        int rtn;
+
+        if (!(buf = read_local(local_name, &size))) {
+                status = 1;
+                return -1;
+        }
+
+        if (cvt_ending) {
+                /* Convert UNIX line endings to Atari */
+                for (x = 0; x != size; ++x)
+                        if (buf[x] == '\n')
+                                buf[x] = 0x9b;
+        }
+
+        rtn = put_data(buf, size, atari_name);
+        free(buf);
+        return rtn;
+}
+
 /* Rename a file */
 
 int atari_rename(char *old_name, char *new_name)
@@ -1284,6 +1945,821 @@ int atari_rename(char *old_name, char *new_name)
         return find_file(old_name, 0, new_name);
 }
 
+/* Recovery: find deleted files and lost chains of sectors.
+ *
+ * Deleting a file only marks its directory entry deleted and frees its
+ * sectors in the VTOC: the sectors are left alone until they're used
+ * again.  Every sector which isn't used by a file is read once, and those
+ * which look like file data (their byte count and link make sense) are
+ * linked up:
+ *
+ *   Deleted directory entries are followed from their first sector for as
+ *   long as each sector still has the entry's file number.
+ *
+ *   The rest are made into chains, each starting with a sector which no
+ *   other one links to.
+ *
+ * The candidates are ranked: whole deleted files first, then partial
+ * ones, then lost chains.
+ */
+
+struct found {
+        char name[24]; /* Name from directory entry, or made up */
+        int file_no; /* Directory entry it had, -1 if none */
+        int score; /* How likely it is to be a real file (0 - 100) */
+        int n; /* Number of sectors */
+        int want; /* Sector count from directory entry, 0 if none */
+        int complete; /* Set if the chain ends properly */
+        int sects[MAX_SECTS]; /* Its sectors, in order */
+        long size; /* Number of data bytes */
+};
+
+struct found *found;
+int found_n;
+
+int comp_found(struct found *l, struct found *r)
+{
+        if (l->score != r->score)
+                return r->score - l->score;
+        return l->sects[0] - r->sects[0];
+}
+
+/* Find candidates: fills in found[] */
+
+void find_lost(void)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        char *owner[MAX_SECTS + 1];
+        int next[MAX_SECTS + 1];
+        int file_no[MAX_SECTS + 1];
+        int bytes[MAX_SECTS + 1];
+        char ok[MAX_SECTS + 1]; /* Set if sector looks like file data */
+        char claimed[MAX_SECTS + 1]; /* Set if sector is in a candidate */
+        char pred[MAX_SECTS + 1]; /* Set if another sector links to it */
+        int lost = 0;
+        int pass;
+        int x;
+
+        found = (struct found *)malloc(sizeof(struct found) * (disk_size + SECTOR_DIR_SIZE * SECTOR_SIZE / ENTRY_SIZE));
+        found_n = 0;
+
+        /* Classify each sector which no file is using */
+        map_owners(owner);
+        memset(ok, 0, sizeof(ok));
+        memset(claimed, 0, sizeof(claimed));
+        memset(pred, 0, sizeof(pred));
+        for (x = 1; x != disk_size; ++x) {
+                file_no[x] = -1;
+                if (owner[x] || getsect(buf, x))
+                        continue;
+                next[x] = (int)buf[data_next_low] + ((int)(0x3 & buf[data_next_high]) << 8);
+                file_no[x] = ((buf[data_file_num] >> 2) & 0x3F);
+                bytes[x] = buf[data_bytes];
+                /* Only the last sector can be short, and an empty one is
+                   more likely never used */
+                ok[x] = (bytes[x] <= data_size && next[x] < disk_size && (next[x] ? bytes[x] == data_size : bytes[x] != 0));
+        }
+
+        /* Deleted directory entries */
+        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
+                int y;
+                if (getsect(buf, x))
+                        break;
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+                        struct found *f = found + found_n;
+                        int sector = (d->start_hi << 8) + d->start_lo;
+                        if (!(d->flag & (FLAG_IN_USE_ED | FLAG_DELETED)))
+                                goto done;
+                        if ((d->flag & FLAG_IN_USE_ED) || !(d->flag & FLAG_DELETED))
+                                continue;
+                        f->file_no = (x - SECTOR_DIR) * SECTOR_SIZE / ENTRY_SIZE + y / ENTRY_SIZE;
+                        f->want = (d->count_hi << 8) + d->count_lo;
+                        f->n = 0;
+                        f->size = 0;
+                        f->complete = 0;
+                        strcpy(f->name, getname(d));
+                        while (sector > 0 && sector < disk_size && !owner[sector] && !claimed[sector] &&
+                               file_no[sector] == f->file_no && bytes[sector] <= data_size) {
+                                claimed[sector] = 1;
+                                f->sects[f->n++] = sector;
+                                f->size += bytes[sector];
+                                if (!next[sector]) {
+                                        f->complete = 1;
+                                        break;
+                                }
+                                sector = next[sector];
+                        }
+                        if (!f->n)
+                                continue;
+                        if (f->complete && f->n == f->want)
+                                f->score = 100;
+                        else if (f->want > f->n)
+                                f->score = 20 + 60 * f->n / f->want;
+                        else
+                                f->score = 20;
+                        ++found_n;
+                }
+        }
+        done:
+
+        /* Lost chains: start with sectors nothing else links to, then any
+           left over (they're in loops) */
+        for (x = 1; x != disk_size; ++x)
+                if (ok[x] && !claimed[x] && next[x] && ok[next[x]] && file_no[next[x]] == file_no[x])
+                        pred[next[x]] = 1;
+        for (pass = 0; pass != 2; ++pass) {
+                for (x = 1; x != disk_size; ++x) {
+                        struct found *f = found + found_n;
+                        int sector = x;
+                        if (!ok[x] || claimed[x] || (!pass && pred[x]))
+                                continue;
+                        f->file_no = -1;
+                        f->want = 0;
+                        f->n = 0;
+                        f->size = 0;
+                        f->complete = 0;
+                        sprintf(f->name, "lost%03d.dat", ++lost);
+                        while (ok[sector] && !claimed[sector] && file_no[sector] == file_no[x]) {
+                                claimed[sector] = 1;
+                                f->sects[f->n++] = sector;
+                                f->size += bytes[sector];
+                                if (!next[sector]) {
+                                        f->complete = 1;
+                                        break;
+                                }
+                                sector = next[sector];
+                        }
+                        f->score = f->complete ? 40 : 20;
+                        /* Binary load files start with FF FF */
+                        if (!getsect(buf, x) && buf[0] == 0xFF && buf[1] == 0xFF)
+                                f->score += 10;
+                        ++found_n;
+                }
+        }
+
+        qsort(found, found_n, sizeof(struct found), (int (*)(const void *, const void *))comp_found);
+}
+
+/* Read candidate's data: returns malloc block */
+
+unsigned char *found_data(struct found *f)
+{
+        unsigned char *data = (unsigned char *)malloc(f->size + 1);
+        long len = 0;
+        int x;
+        for (x = 0; x != f->n; ++x) {
+                unsigned char buf[DD_SECTOR_SIZE];
+                if (getsect(buf, f->sects[x]))
+                        break;
+                memcpy(data + len, buf, buf[data_bytes]);
+                len += buf[data_bytes];
+        }
+        return data;
+}
+
+/* Get candidate by its number in the list */
+
+struct found *found_by_number(char *s)
+{
+        int n = atoi(s);
+        if (n < 1 || n > found_n) {
+                fprintf(stderr, "No candidate %s: there are %d\n", s, found_n);
+                status = 1;
+                return 0;
+        }
+        return found + n - 1;
+}
+
+/* List candidates, or extract them if extract is set */
+
+int do_recover(int argc, char *argv[], int x)
+{
+        char *out_dir = 0;
+        int extract = 0;
+        int y;
+
+        for (; x != argc && argv[x][0] == '-'; ++x) {
+                if (!strcmp(argv[x], "-x")) {
+                        extract = 1;
+                } else if (!strcmp(argv[x], "-o") && x + 1 != argc) {
+                        out_dir = argv[++x];
+                        extract = 1;
+                } else {
+                        fprintf(stderr, "Unknown option '%s'\n", argv[x]);
+                        return -1;
+                }
+        }
+
+        find_lost();
+
+        if (!extract) {
+                if (!found_n) {
+                        printf("Nothing found\n");
+                        return 0;
+                }
+                printf("  #  score  sects  bytes  first  name          found as\n");
+                for (y = 0; y != found_n; ++y) {
+                        struct found *f = found + y;
+                        printf("%3d  %5d  %5d  %5ld  %5d  %-12s  ", y + 1, f->score, f->n, f->size, f->sects[0], f->name);
+                        if (f->file_no == -1)
+                                printf("lost chain%s\n", f->complete ? "" : ", broken");
+                        else if (f->complete && f->n == f->want)
+                                printf("deleted file\n");
+                        else
+                                printf("deleted file, %d of %d sectors%s\n", f->n, f->want, f->complete ? "" : ", broken");
+                }
+                return status;
+        }
+
+        /* Extract all, or the ones listed */
+        for (y = x; y != argc; ++y)
+                if (!found_by_number(argv[y]))
+                        return -1;
+        for (y = 0; y != found_n; ++y) {
+                struct found *f = found + y;
+                char *local_name = f->name;
+                unsigned char *data;
+                FILE *o;
+                if (x != argc) {
+                        int z;
+                        for (z = x; z != argc && atoi(argv[z]) != y + 1; ++z);
+                        if (z == argc)
+                                continue;
+                }
+                if (out_dir) {
+                        local_name = (char *)malloc(strlen(out_dir) + strlen(f->name) + 2);
+                        sprintf(local_name, "%s/%s", out_dir, f->name);
+                }
+                printf("extracting %d to %s\n", y + 1, local_name);
+                data = found_data(f);
+                if (!(o = fopen(local_name, "wb"))) {
+                        fprintf(stderr, "Couldn't open local file '%s'\n", local_name);
+                        status = 1;
+                } else if ((f->size && 1 != fwrite(data, f->size, 1, o)) | fclose(o)) {
+                        fprintf(stderr, "Couldn't write local file '%s'\n", local_name);
+                        status = 1;
+                }
+                free(data);
+                if (out_dir)
+                        free(local_name);
+        }
+        return status;
+}
+
+/* Put a candidate back in the directory */
+
+int do_restore(char *number, char *atari_name)
+{
+        unsigned char bitmap[ED_BITMAP_SIZE];
+        unsigned char buf[DD_SECTOR_SIZE];
+        struct found *f;
+        int slot = -1;
+        int ed_file = 0;
+        int x;
+
+        find_lost();
+        if (!(f = found_by_number(number)))
+                return -1;
+        if (!atari_name)
+                atari_name = f->name;
+        if (find_file(atari_name, 0, NULL) != -1) {
+                fprintf(stderr, "'%s' already exists: give another name\n", atari_name);
+                return -1;
+        }
+
+        /* Use its old directory entry if it's still free */
+        if (f->file_no != -1) {
+                if (getsect(buf, SECTOR_DIR + f->file_no / (SECTOR_SIZE / ENTRY_SIZE))) {
+                        fprintf(stderr, " (trying to read directory)\n");
+                        return -1;
+                }
+                if (!(((struct dirent *)(buf + ENTRY_SIZE * (f->file_no % (SECTOR_SIZE / ENTRY_SIZE))))->flag & FLAG_IN_USE_ED))
+                        slot = f->file_no;
+        }
+        if (slot == -1 && (slot = find_empty_entry()) == -1) {
+                fprintf(stderr, "Directory is full\n");
+                return -1;
+        }
+
+        /* Sectors get the file number of the entry, and the chain ends at
+           the last one we have */
+        getmap(bitmap, 0);
+        for (x = 0; x != f->n; ++x) {
+                int upd = 0;
+                if (getsect(buf, f->sects[x]))
+                        return -1;
+                if (((buf[data_file_num] >> 2) & 0x3F) != slot) {
+                        buf[data_file_num] = (buf[data_file_num] & 0x3) | (slot << 2);
+                        upd = 1;
+                }
+                if (x + 1 == f->n && (buf[data_next_low] || (buf[data_next_high] & 0x3))) {
+                        buf[data_next_low] = 0;
+                        buf[data_next_high] &= ~0x3;
+                        upd = 1;
+                }
+                if (upd)
+                        putsect(buf, f->sects[x]);
+                mark_space(bitmap, f->sects[x], 1);
+                if (f->sects[x] >= 720)
+                        ed_file = 1;
+        }
+        putmap(bitmap);
+        write_dir(slot, atari_name, ed_file ? -f->sects[0] : f->sects[0], f->n);
+        printf("Restored %s (%d sectors, %ld bytes)\n", atari_name, f->n, f->size);
+        return status;
+}
+
+/* Zero what the filesystem doesn't use, so images compress and dedupe
+ * better: free sectors, and the bytes past the end of the data in each file
+ * sector.  Sectors the VTOC shows in use but no file owns are left alone:
+ * they may be a boot program's, run check to see.  The boot sectors, VTOC
+ * and directory aren't touched.  With dry set, only count the bytes which
+ * would change.  Returns number of bytes, sets *sects to the number of
+ * sectors and *kept to the number left alone.
+ */
+
+long scrub(int dry, int *sects, int *kept)
+{
+        unsigned char bitmap[ED_BITMAP_SIZE];
+        unsigned char buf[DD_SECTOR_SIZE];
+        char *owner[MAX_SECTS + 1];
+        char *reserved[MAX_SECTS + 1];
+        long changed = 0;
+        int x;
+
+        *sects = 0;
+        *kept = 0;
+
+        map_owners(owner);
+        map_reserved(reserved);
+        getmap(bitmap, 0);
+        for (x = 1; x != disk_size; ++x) {
+                int start;
+                int y;
+                int n = 0;
+                if (reserved[x])
+                        continue;
+                if (!owner[x] && !(bitmap[x >> 3] & (1 << (7 - (x & 7))))) {
+                        ++*kept;
+                        continue;
+                }
+                if (getsect(buf, x))
+                        return -1;
+                if (owner[x]) {
+                        /* File sector: bytes past its data, up to the link */
+                        start = buf[data_bytes];
+                        if (start > data_size)
+                                continue;
+                        for (y = start; y != data_size; ++y)
+                                if (buf[y])
+                                        ++n;
+                        memset(buf + start, 0, data_size - start);
+                } else {
+                        for (y = 0; y != sector_size; ++y)
+                                if (buf[y])
+                                        ++n;
+                        memset(buf, 0, sector_size);
+                }
+                if (n) {
+                        changed += n;
+                        ++*sects;
+                        if (!dry)
+                                putsect(buf, x);
+                }
+        }
+        return changed;
+}
+
+int do_scrub(int dry)
+{
+        int sects, kept;
+        long changed = scrub(dry, &sects, &kept);
+        if (changed == -1)
+                return -1;
+        printf("%s %ld bytes in %d sectors\n", dry ? "Would zero" : "Zeroed", changed, sects);
+        if (kept)
+                printf("Left %d sectors alone: VTOC shows them in use, but no file owns them\n", kept);
+        return status;
+}
+
+/* Rewrite the disk in a canonical layout, so that disks holding the same
+ * files are the same byte for byte.  The files are sorted by name (but
+ * dos.sys is always first) and get directory entries and sectors in that
+ * order, each one in consecutive sectors with every sector but the last
+ * full.  Deleted entries, stale flag bits (only in use, DOS 2 and locked
+ * are kept), whatever follows the end of directory mark (like find_file(),
+ * we stop there) and the unused parts of the VTOC are cleared, then the
+ * disk is scrubbed.  The boot sectors and sectors the VTOC has in use but
+ * no file owns are kept as they are.
+ * Everything is read into memory before anything is written.
+ */
+
+struct canon {
+        struct dirent d; /* Directory entry */
+        unsigned char *data; /* File contents */
+        long size;
+};
+
+/* dos.sys goes first, where the boot sectors expect it to start */
+
+int comp_canon(struct canon *l, struct canon *r)
+{
+        int c = memcmp(l->d.name, r->d.name, sizeof(l->d.name) + sizeof(l->d.suffix));
+        int l_dos = !memcmp(l->d.name, "DOS     SYS", 11);
+        int r_dos = !memcmp(r->d.name, "DOS     SYS", 11);
+        if (l_dos != r_dos)
+                return r_dos - l_dos;
+        if (c)
+                return c;
+        if (l->size != r->size)
+                return l->size < r->size ? -1 : 1;
+        return memcmp(l->data, r->data, l->size);
+}
+
+int do_canonicalize(void)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        unsigned char dir[SECTOR_DIR_SIZE][DD_SECTOR_SIZE];
+        unsigned char bitmap[ED_BITMAP_SIZE];
+        struct canon files[SECTOR_DIR_SIZE * SECTOR_SIZE / ENTRY_SIZE];
+        char *owner[MAX_SECTS + 1];
+        char *reserved[MAX_SECTS + 1];
+        char used[MAX_SECTS + 1];
+        int nfiles = 0;
+        int total = 0;
+        int sects, kept;
+        long changed;
+        int x, y, z;
+
+        /* Read every file */
+        map_reserved(reserved);
+        memset(used, 0, sizeof(used));
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x) {
+                if (getsect(dir[x], SECTOR_DIR + x)) {
+                        fprintf(stderr, " (trying to read directory)\n");
+                        return -1;
+                }
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(dir[x] + y);
+                        struct canon *f = files + nfiles;
+                        struct chain c[1];
+                        if (!(d->flag & (FLAG_IN_USE_ED | FLAG_DELETED)))
+                                goto done;
+                        if (!(d->flag & FLAG_IN_USE_ED))
+                                continue;
+                        c->file_no = x * (SECTOR_SIZE / ENTRY_SIZE) + y / ENTRY_SIZE;
+                        f->d = *d;
+                        f->size = 0;
+                        /* put writes empty files without any sectors */
+                        if (!d->start_lo && !d->start_hi && !d->count_lo && !d->count_hi) {
+                                f->data = (unsigned char *)malloc(1);
+                                ++nfiles;
+                                continue;
+                        }
+                        if (read_chain(c, d, reserved, used)) {
+                                fprintf(stderr, "File '%s' has a damaged sector chain: run fix first\n", getname(d));
+                                return -1;
+                        }
+                        f->data = (unsigned char *)malloc((long)data_size * c->n + 1);
+                        for (z = 0; z != c->n; ++z) {
+                                unsigned char *p = c->data + (long)z * DD_SECTOR_SIZE;
+                                if (p[data_bytes] > data_size) {
+                                        fprintf(stderr, "File '%s' has a damaged sector: run fix first\n", getname(d));
+                                        return -1;
+                                }
+                                memcpy(f->data + f->size, p, p[data_bytes]);
+                                f->size += p[data_bytes];
+                        }
+                        free(c->data);
+                        free(c->sects);
+                        ++nfiles;
+                }
+        }
+        done:
+        qsort(files, nfiles, sizeof(struct canon), (int (*)(const void *, const void *))comp_canon);
+
+        /* Free every sector files were using */
+        map_owners(owner);
+        getmap(bitmap, 0);
+        for (x = 1; x != disk_size; ++x)
+                if (owner[x] && !reserved[x])
+                        mark_space(bitmap, x, 0);
+
+        /* Write files in order.  An empty file still gets a sector, like
+           DOS writes. */
+        memset(dir, 0, sizeof(dir));
+        for (x = 0; x != nfiles; ++x) {
+                struct canon *f = files + x;
+                struct dirent *d = (struct dirent *)(dir[x / (SECTOR_SIZE / ENTRY_SIZE)] + ENTRY_SIZE * (x % (SECTOR_SIZE / ENTRY_SIZE)));
+                int n = (f->size + data_size - 1) / data_size;
+                int first;
+                unsigned char *data;
+                if (!n)
+                        n = 1;
+                data = (unsigned char *)calloc((long)n * data_size + 1, 1);
+                memcpy(data, f->data, f->size);
+                first = write_file(bitmap, data, n, x, f->size);
+                free(data);
+                free(f->data);
+                if (first == -1) {
+                        fprintf(stderr, "Couldn't write file\n");
+                        status = 1;
+                        return -1;
+                }
+                memcpy(d, &f->d, ENTRY_SIZE);
+                d->flag = (first < 0 ? FLAG_OPENED : FLAG_IN_USE) | FLAG_DOS2 | (f->d.flag & FLAG_LOCKED);
+                if (first < 0)
+                        first = -first;
+                d->start_lo = first;
+                d->start_hi = (first >> 8);
+                d->count_lo = n;
+                d->count_hi = (n >> 8);
+                total += n;
+        }
+        for (x = 0; x != SECTOR_DIR_SIZE; ++x)
+                putsect(dir[x], SECTOR_DIR + x);
+        putmap(bitmap);
+
+        /* Clear unused parts of VTOC */
+        if (getsect(buf, SECTOR_VTOC)) {
+                fprintf(stderr, " (trying to read VTOC)\n");
+                return -1;
+        }
+        memset(buf + VTOC_RESERVED, 0, VTOC_BITMAP - VTOC_RESERVED);
+        memset(buf + VTOC_BITMAP + SD_BITMAP_SIZE, 0, sector_size - (VTOC_BITMAP + SD_BITMAP_SIZE));
+        putsect(buf, SECTOR_VTOC);
+        if (disk_size == ED_DISK_SIZE) {
+                if (getsect(buf, SECTOR_VTOC2)) {
+                        fprintf(stderr, " (trying to read VTOC2)\n");
+                        return -1;
+                }
+                memset(buf + VTOC2_NUM_UNUSED + 2, 0, sector_size - (VTOC2_NUM_UNUSED + 2));
+                putsect(buf, SECTOR_VTOC2);
+        }
+
+        changed = scrub(0, &sects, &kept);
+        if (changed == -1)
+                return -1;
+        printf("%d files, %d sectors, zeroed %ld bytes in %d sectors\n", nfiles, total, changed, sects);
+        if (kept)
+                printf("Left %d sectors alone: VTOC shows them in use, but no file owns them\n", kept);
+        return status;
+}
+
+/* Read a file's data into memory, without the link bytes: returns malloc
+   block.  A damaged chain is reported and what could be read is returned. */
+
+unsigned char *chain_data(struct dirent *d, long *size)
+{
+        unsigned char *data = (unsigned char *)malloc((long)data_size * disk_size + 1);
+        int sector = (d->start_hi << 8) + d->start_lo;
+        int count = 0;
+        *size = 0;
+        /* put writes empty files without any sectors */
+        while (sector) {
+                unsigned char buf[DD_SECTOR_SIZE];
+                int bytes;
+                if (sector >= disk_size || count++ == disk_size || getsect(buf, sector)) {
+                        fprintf(stderr, "File '%s' has a damaged sector chain\n", getname(d));
+                        status = 1;
+                        break;
+                }
+                bytes = buf[data_bytes];
+                if (bytes > data_size)
+                        bytes = data_size;
+                memcpy(data + *size, buf, bytes);
+                *size += bytes;
+                sector = (int)buf[data_next_low] + ((int)(0x3 & buf[data_next_high]) << 8);
+        }
+        return data;
+}
+
+/* Content fingerprints: each file's hash covers just its data bytes, not
+ * the links, so it doesn't matter where on the disk the file is.  The
+ * filesystem hash covers the boot sectors and the name, size and hash of
+ * each file, in name order, so free space, deleted entries, flags and
+ * layout don't change it.  Both are fnv_hash(): fast, but not
+ * cryptographic.
+ */
+
+struct file_hash {
+        char name[16];
+        long size;
+        unsigned long long hash;
+        int image; /* Which image it's from, for hash_command() */
+};
+
+int comp_file_hash(struct file_hash *l, struct file_hash *r)
+{
+        return strcmp(l->name, r->name);
+}
+
+/* Hash every file in the directory: returns number of files, sorted by
+   name, in malloc block *files */
+
+int hash_files(struct file_hash **files)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int n = 0;
+        int x;
+
+        *files = (struct file_hash *)malloc(sizeof(struct file_hash) * (SECTOR_DIR_SIZE * SECTOR_SIZE / ENTRY_SIZE));
+        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
+                int y;
+                if (getsect(buf, x)) {
+                        fprintf(stderr, " (trying to read directory)\n");
+                        break;
+                }
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+                        struct file_hash *f = *files + n;
+                        unsigned char *data;
+                        if (!(d->flag & (FLAG_IN_USE_ED | FLAG_DELETED)))
+                                goto done;
+                        if (!(d->flag & FLAG_IN_USE_ED))
+                                continue;
+                        strcpy(f->name, getname(d));
+                        data = chain_data(d, &f->size);
+                        f->hash = fnv_hash(FNV_INIT, data, f->size);
+                        f->image = 0;
+                        free(data);
+                        ++n;
+                }
+        }
+        done:
+        qsort(*files, n, sizeof(struct file_hash), (int (*)(const void *, const void *))comp_file_hash);
+        return n;
+}
+
+/* Filesystem hash from hash_files() list */
+
+unsigned long long fs_hash(struct file_hash *files, int n)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        unsigned long long h = FNV_INIT;
+        int x;
+        for (x = 1; x != 4; ++x)
+                if (!getsect(buf, x))
+                        h = fnv_hash(h, buf, SECTOR_SIZE);
+        for (x = 0; x != n; ++x) {
+                unsigned char word[16];
+                int y;
+                for (y = 0; y != 8; ++y) {
+                        word[y] = (unsigned char)(files[x].size >> (8 * y));
+                        word[y + 8] = (unsigned char)(files[x].hash >> (8 * y));
+                }
+                h = fnv_hash(h, (unsigned char *)files[x].name, strlen(files[x].name) + 1);
+                h = fnv_hash(h, word, sizeof(word));
+        }
+        return h;
+}
+
+int do_hash(void)
+{
+        struct file_hash *files;
+        int n = hash_files(&files);
+        int x;
+        for (x = 0; x != n; ++x)
+                printf("%016llx %7ld  %s\n", files[x].hash, files[x].size, files[x].name);
+        printf("%016llx          (filesystem)\n", fs_hash(files, n));
+        free(files);
+        return status;
+}
+
+/* Search file contents for pat.  Files are searched as a whole, so matches
+   which cross from one sector into the next are found.  Each match is
+   printed as image:file:offset.  With mode GREP_LINES, the ATASCII line
+   (ending with EOL) holding the match is printed after it, once per line.
+   With mode GREP_FILES, just image:file is printed, once per file.
+   Returns number of matches. */
+
+#define GREP_LINES 1
+#define GREP_FILES 2
+
+long grep_disk(char *image, unsigned char *pat, int len, int mode)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        long matches = 0;
+        int x;
+        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
+                int y;
+                if (getsect(buf, x)) {
+                        fprintf(stderr, " (trying to read directory)\n");
+                        break;
+                }
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+                        unsigned char *data, *p, *end;
+                        long size;
+                        if (!(d->flag & (FLAG_IN_USE_ED | FLAG_DELETED)))
+                                return matches;
+                        if (!(d->flag & FLAG_IN_USE_ED))
+                                continue;
+                        data = chain_data(d, &size);
+                        end = data + size;
+                        /* memchr() is fast (it's vectorized in glibc), so
+                           use it to find candidates */
+                        for (p = data; end - p >= len && (p = (unsigned char *)memchr(p, pat[0], end - p + 1 - len)); ++p) {
+                                if (memcmp(p, pat, len))
+                                        continue;
+                                ++matches;
+                                if (mode == GREP_FILES) {
+                                        printf("%s:%s\n", image, getname(d));
+                                        break;
+                                }
+                                printf("%s:%s:%ld", image, getname(d), (long)(p - data));
+                                if (mode == GREP_LINES) {
+                                        unsigned char *s = p;
+                                        unsigned char *e = p + len - 1;
+                                        while (s != data && s[-1] != 0x9B)
+                                                --s;
+                                        while (e != end && *e != 0x9B)
+                                                ++e;
+                                        printf(":");
+                                        fwrite(s, e - s, 1, stdout);
+                                        /* Next match is on a later line */
+                                        p = (e == end ? end - 1 : e);
+                                }
+                                printf("\n");
+                        }
+                        free(data);
+                }
+        }
+        return matches;
+}
+
+/* Parse DOS binary load file in buf: make list of its segments and load
+   them into membuf.  Returns 0 if the whole file parsed, -1 if it's not a
+   binary file or it's damaged or truncated (segments has what could be
+   parsed). */
+
+int load_segments(unsigned char *buf, size_t total, unsigned char *membuf, struct segment **segments)
+{
+        struct segment *lastseg = 0;
+        size_t idx;
+        int ok = 1;
+        int segsize;
+        *segments = 0;
+        if (total < 2 || buf[0] != 0xFF || buf[1] != 0xFF) /* Magic number for binary file */
+                return -1;
+        for (idx = 0; ok && idx < total; idx += segsize) {
+                segsize = 0;
+                ok = 0;
+                /* Each segment can optionally start with 0xFFFF, skip it */
+                if (idx + 2 <= total && buf[idx] == 0xFF && buf[idx + 1] == 0xFF) {
+                        idx += 2;
+                        ok = 1;
+                }
+                /* Get header */
+                if (idx + 4 <= total) {
+                        struct segment *segment;
+                        int first = (int)buf[idx + 0] + ((int)buf[idx + 1] << 8);
+                        int last = (int)buf[idx + 2] + ((int)buf[idx + 3] << 8);
+                        segsize = last - first + 1;
+                        idx += 4;
+                        ok = 1;
+                        if (segsize < 1) { /* Bad load format? */
+                                return -1;
+                        }
+                        /* Ignore short segments (DUP.SYS loader will not skip them) */
+                        if (segsize > 1) {
+                                unsigned char vec[4];
+                                int v;
+                                segment = (struct segment *)malloc(sizeof(struct segment));
+                                segment->start = first;
+                                segment->size = segsize;
+                                segment->next = 0;
+                                segment->init = -1;
+                                segment->run = -1;
+                                if (!*segments)
+                                        *segments = segment;
+                                if (lastseg)
+                                        lastseg->next = segment;
+                                lastseg = segment;
+                                /* Markers to see if segment sets RUNAD or INITAD */
+                                memcpy(vec, membuf + 0x2e0, 4);
+                                membuf[0x2e0] = 0xFE;
+                                membuf[0x2e1] = 0xFE;
+                                membuf[0x2e2] = 0xFE;
+                                membuf[0x2e3] = 0xFE;
+                                memcpy(membuf + first, buf + idx, (idx + segsize <= total ? (size_t)segsize : total - idx));
+                                if (membuf[0x2e0]!=0xFE || membuf[0x2e1]!=0xFE)
+                                        segment->run = (int)membuf[0x2e0] + ((int)membuf[0x2e1] << 8);
+                                if (membuf[0x2e2]!=0xFE || membuf[0x2e3]!=0xFE)
+                                        segment->init = (int)membuf[0x2e2] + ((int)membuf[0x2e3] << 8);
+                                /* Put back what was there where segment didn't load */
+                                for (v = 0; v != 4; ++v)
+                                        if (0x2e0 + v < first || 0x2e0 + v > last)
+                                                membuf[0x2e0 + v] = vec[v];
+                        } else if (idx < total) {
+                                membuf[first] = buf[idx];
+                        }
+                }
+        }
+        return (ok && idx == total) ? 0 : -1;
+}
+
 /* Get info about file: actual size, etc. */
 
 void get_info(struct name *nam)
@@ -1292,7 +2768,8 @@ void get_info(struct name *nam)
         unsigned char membuf[65536];
         size_t total = 0;
         int sector = nam->sector;
-        struct segment *lastseg = 0;
+        int chain[MAX_SECTS];
+        int n = 0;
         do {
                 unsigned char buf[DD_SECTOR_SIZE];
                 int next;
@@ -1312,6 +2789,8 @@ void get_info(struct name *nam)
                 next = (int)buf[data_next_low] + ((int)(0x3 & buf[data_next_high]) << 8);
                 file_no = ((buf[data_file_num] >> 2) & 0x3F);
                 bytes = buf[data_bytes];
+                if (n != MAX_SECTS)
+                        chain[n++] = sector;
 
                 if (bytes && total + bytes <= sizeof(bigbuf)) {
                         memcpy(bigbuf + total, buf, bytes);
@@ -1325,106 +2804,426 @@ void get_info(struct name *nam)
         nam->size = total;
         nam->segments = 0;
 
-        // Look at file...
-        if (total >= 2 && bigbuf[0] == 0xFF && bigbuf[1] == 0xFF) { /* Magic number for binary file */
-                size_t idx;
-                int ok = 1;
-                int segsize;
-                for (idx = 0; ok && idx < total; idx += segsize) {
-                        segsize = 0;
-                        ok = 0;
-                        /* Each segment can optionally start with 0xFFFF, skip it */
-                        if (idx + 2 <= total && bigbuf[idx] == 0xFF && bigbuf[idx + 1] == 0xFF) {
-                                idx += 2;
-                                ok = 1;
-                        }
-                        /* Get header */
-                        if (idx + 4 <= total) {
-                                struct segment *segment;
-                                int first = (int)bigbuf[idx + 0] + ((int)bigbuf[idx + 1] << 8);
-                                int last = (int)bigbuf[idx + 2] + ((int)bigbuf[idx + 3] << 8);
-                                segsize = last - first + 1;
-                                idx += 4;
-                                ok = 1;
-                                if (segsize < 1) { /* Bad load format? */
-                                        break;
-                                }
-                                /* Ignore short segments (DUP.SYS loader will not skip them) */
-                                if (segsize > 1) {
-                                        segment = (struct segment *)malloc(sizeof(struct segment));
-                                        segment->start = first;
-                                        segment->size = segsize;
-                                        segment->next = 0;
-                                        segment->init = -1;
-                                        segment->run = -1;
-                                        if (!nam->segments)
-                                                nam->segments = segment;
-                                        if (lastseg)
-                                                lastseg->next = segment;
-                                        lastseg = segment;
-                                        membuf[0x2e0] = 0xFE;
-                                        membuf[0x2e1] = 0xFE;
-                                        membuf[0x2e2] = 0xFE;
-                                        membuf[0x2e3] = 0xFE;
-                                        memcpy(membuf + first, bigbuf + idx, segsize);
-                                        if (membuf[0x2e0]!=0xFE || membuf[0x2e1]!=0xFE)
-                                                segment->run = (int)membuf[0x2e0] + ((int)membuf[0x2e1] << 8);
-                                        if (membuf[0x2e2]!=0xFE || membuf[0x2e3]!=0xFE)
-                                                segment->init = (int)membuf[0x2e2] + ((int)membuf[0x2e3] << 8);
-                                }
+        /* DOS reads the directory, then the file */
+        if (ls_drive)
+                nam->load_time = sio_load_time(ls_drive, disk->sec_size, disk->nsects, NULL, SECTOR_DIR, chain, n);
+
+        load_segments(bigbuf, total, membuf, &nam->segments);
+}
+
+/* Write memory image of a binary file after it's loaded, and print the
+   init addresses in the order they are called, then the run address.  The
+   init routines are not run, so the image is what was loaded: RUNAD and
+   INITAD hold what the file put there, if anything. */
+
+int do_snapshot(char *name, char *out_name)
+{
+        FILE *f;
+        unsigned char *buf;
+        unsigned char *membuf;
+        struct segment *segments, *seg;
+        long size;
+        int run = -1;
+        int sector = find_file(name, 0, NULL);
+        if (sector == -1) {
+                fprintf(stderr,"File '%s' not found\n", name);
+                return -1;
+        }
+        if (!(buf = read_data(sector, &size)))
+                return -1;
+
+        membuf = (unsigned char *)calloc(65536, 1);
+        if (load_segments(buf, size, membuf, &segments)) {
+                fprintf(stderr, "'%s' is not a binary load file, or it's damaged\n", name);
+                free(buf);
+                free(membuf);
+                return -1;
+        }
+        free(buf);
+
+        for (seg = segments; seg; seg = seg->next) {
+                if (seg->init != -1)
+                        printf("init=%x\n", seg->init);
+                if (seg->run != -1)
+                        run = seg->run;
+        }
+        if (run != -1)
+                printf("run=%x\n", run);
+
+        if (!(f = fopen(out_name, "wb"))) {
+                fprintf(stderr, "Couldn't open local file '%s'\n", out_name);
+                free(membuf);
+                return -1;
+        }
+        if (1 != fwrite(membuf, 65536, 1, f) || fclose(f)) {
+                fprintf(stderr, "Couldn't write local file '%s'\n", out_name);
+                free(membuf);
+                return -1;
+        }
+        free(membuf);
+        return status;
+}
+
+/* Read directory into names/name_n array
+ * If info_flg is set, read file to measure it real length
+ * If all_flg is set, included system files in
+ */
+
+void read_dir(int all_flg, int info_flg)
+{
+        unsigned char buf[DD_SECTOR_SIZE];
+        int x;
+        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
+                int y;
+                if (getsect(buf, x)) {
+                        fprintf(stderr," (trying to read directory)\n");
+                        break;
+                }
+                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
+                        struct dirent *d = (struct dirent *)(buf + y);
+
+                        if (!(d->flag & (FLAG_IN_USE_ED | FLAG_DELETED)))
+                                goto done;
+
+                        if (d->flag & FLAG_IN_USE_ED) {
+                                struct name *nam;
+                                char *s = getname(d);
+                                nam = (struct name *)malloc(sizeof(struct name));
+                                memset(nam, 0, sizeof(struct name));
+                                nam->name = strdup(s);
+                                if (d->flag & FLAG_LOCKED)
+                                        nam->locked = 1;
+                                else
+                                        nam->locked = 0;
+                                nam->sector = d->start_lo + (d->start_hi * 256);
+                                nam->sects = d->count_lo + (d->count_hi * 256);
+                                nam->segments = 0;
+                                nam->size = -1;
+                                if (info_flg)
+                                        get_info(nam);
+
+                                if (!strcmp(nam->name, "dos.sys") || !strcmp(nam->name, "dup.sys"))
+                                        nam->is_sys = 1;
+                                else
+                                        nam->is_sys = 0;
+
+                                if (strlen(nam->name) > 4 && !strcmp(nam->name + strlen(nam->name) - 4, ".com"))
+                                        nam->is_cm = 1;
+                                else
+                                        nam->is_cm = 0;
+
+                                if ((all_flg || !nam->is_sys))
+                                        names[name_n++] = nam;
                         }
                 }
         }
+        done:;
+}
+
+/* Forget directory read by read_dir() */
+
+void free_dir(void)
+{
+        while (name_n) {
+                struct name *nam = names[--name_n];
+                struct segment *seg;
+                while ((seg = nam->segments)) {
+                        nam->segments = seg->next;
+                        free(seg);
+                }
+                free(nam->name);
+                free(nam);
+        }
+}
+
+/* A file in a local directory */
+
+struct host_file {
+        char *path; /* Local path */
+        char *name; /* Atari name */
+        unsigned char *data; /* Contents */
+        long size;
+        struct name *on_disk; /* File with same name on disk, or NULL */
+        int same; /* Set if file on disk has the same contents */
+};
+
+/* Convert local file name to Atari name */
+
+char *atari_name_of(char *local_name)
+{
+        struct dirent d[1];
+        putname(d, local_name);
+        return getname(d);
+}
+
+/* Check if Atari name is in list of local names (NULL terminated) */
+
+int in_list(char *name, char **list)
+{
+        while (*list)
+                if (!strcmp(atari_name_of(*list++), name))
+                        return 1;
+        return 0;
+}
+
+/* Read files in local directory, in name order: returns how many, or -1
+   on error.  Files which don't have a good Atari name are skipped.  If only
+   is not NULL, just the files named in it are read. */
+
+int read_host_dir(char *dir_name, struct host_file **files, char **only)
+{
+#ifdef HAVE_GLOB
+        glob_t g[1];
+        struct stat st;
+        char *pat;
+        int n = 0;
+        size_t x;
+
+        /* Don't take a missing directory for an empty one */
+        if (stat(dir_name, &st) || !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "'%s' is not a directory\n", dir_name);
+                return -1;
+        }
+        pat = (char *)malloc(strlen(dir_name) + 3);
+        sprintf(pat, "%s/*", dir_name);
+        x = glob(pat, 0, NULL, g);
+        free(pat);
+        if (x == GLOB_NOMATCH) {
+                *files = 0;
+                return 0;
+        } else if (x) {
+                fprintf(stderr, "Couldn't read directory '%s'\n", dir_name);
+                return -1;
+        }
+        *files = (struct host_file *)malloc(sizeof(struct host_file) * (g->gl_pathc + 1));
+        for (x = 0; x != g->gl_pathc; ++x) {
+                struct host_file *h = *files + n;
+                struct dirent d[1];
+                char *base = strrchr(g->gl_pathv[x], '/') + 1;
+                char *s, *t;
+                int y;
+                if (only) {
+                        for (y = 0; only[y] && strcmp(only[y], base); ++y);
+                        if (!only[y])
+                                continue;
+                }
+                if (stat(g->gl_pathv[x], &st) || !S_ISREG(st.st_mode))
+                        continue;
+                /* Atari name must give back the same name */
+                putname(d, base);
+                s = getname(d);
+                for (t = base; *s && lower(*t) == *s; ++s, ++t);
+                if (*s || *t) {
+                        fprintf(stderr, "Skipping '%s': not an Atari file name\n", g->gl_pathv[x]);
+                        continue;
+                }
+                for (y = 0; y != n && strcmp((*files)[y].name, getname(d)); ++y);
+                if (y != n) {
+                        fprintf(stderr, "Skipping '%s': same Atari name as '%s'\n", g->gl_pathv[x], (*files)[y].path);
+                        continue;
+                }
+                if (!(h->data = read_local(g->gl_pathv[x], &h->size))) {
+                        globfree(g);
+                        return -1;
+                }
+                h->path = strdup(g->gl_pathv[x]);
+                h->name = strdup(getname(d));
+                h->on_disk = 0;
+                h->same = 0;
+                ++n;
+        }
+        globfree(g);
+        return n;
+#else
+        (void)files;
+        (void)only;
+        fprintf(stderr, "Can't read '%s': sync needs glob() (build with -DHAVE_GLOB)\n", dir_name);
+        return -1;
+#endif
+}
+
+void free_host_dir(struct host_file *files, int n)
+{
+        while (n--) {
+                free(files[n].path);
+                free(files[n].name);
+                free(files[n].data);
+        }
+        free(files);
 }
 
-/* Read directory into names/name_n array
- * If info_flg is set, read file to measure it real length
- * If all_flg is set, included system files in
- */
+/* Mirror local directory onto the disk: files which differ from the ones
+   on the disk are written, files which aren't in the directory are deleted
+   and the rest are left alone.  dos.sys and dup.sys belong to DOS, not to
+   the directory: they're written if the directory has them, but never
+   deleted.  It all happens or none of it does: nothing
+   is changed if it doesn't fit, and the image is written all at once.  If
+   only is not NULL, just the files named in it are looked at. */
 
-void read_dir(int all_flg, int info_flg)
+int do_sync(char *dir_name, char **only)
 {
-        unsigned char buf[DD_SECTOR_SIZE];
-        int x;
-        for (x = SECTOR_DIR; x != SECTOR_DIR + SECTOR_DIR_SIZE; ++x) {
-                int y;
-                if (getsect(buf, x)) {
-                        fprintf(stderr," (trying to read directory)\n");
-                        break;
+        struct host_file *files;
+        unsigned char bitmap[ED_BITMAP_SIZE];
+        int nfiles;
+        int avail, need = 0;
+        int entries;
+        int written = 0, deleted = 0, unchanged = 0;
+        int x, y;
+
+        if ((nfiles = read_host_dir(dir_name, &files, only)) < 0)
+                return -1;
+        free_dir();
+        read_dir(1, 0);
+        getmap(bitmap, 0);
+        avail = amount_free(bitmap);
+        entries = name_n;
+
+        /* Work out what has to be done */
+        for (x = 0; x != nfiles; ++x) {
+                struct host_file *h = files + x;
+                for (y = 0; y != name_n && strcmp(names[y]->name, h->name); ++y);
+                if (y != name_n) {
+                        unsigned char *data;
+                        long size;
+                        h->on_disk = names[y];
+                        data = read_data(names[y]->sector, &size);
+                        h->same = (data && size == h->size && !memcmp(data, h->data, size));
+                        free(data);
+                        if (!h->same)
+                                avail += names[y]->sects;
+                } else
+                        ++entries;
+                if (!h->same)
+                        need += (h->size + data_size - 1) / data_size;
+        }
+        for (y = 0; y != name_n; ++y) {
+                for (x = 0; x != nfiles && files[x].on_disk != names[y]; ++x);
+                if (x == nfiles && !names[y]->is_sys && (!only || in_list(names[y]->name, only))) {
+                        avail += names[y]->sects;
+                        --entries;
                 }
-                for (y = 0; y != SECTOR_SIZE; y += ENTRY_SIZE) {
-                        struct dirent *d = (struct dirent *)(buf + y);
+        }
+        if (need > avail || entries > (SECTOR_DIR_SIZE * SECTOR_SIZE) / ENTRY_SIZE) {
+                fprintf(stderr, "Not enough space: %d sectors and %d directory entries needed, %d and %d available\n",
+                        need, entries, avail, (SECTOR_DIR_SIZE * SECTOR_SIZE) / ENTRY_SIZE);
+                free_host_dir(files, nfiles);
+                return -1;
+        }
 
-                        if (!(d->flag & (FLAG_IN_USE_ED | FLAG_DELETED)))
-                                goto done;
+        /* Do it */
+        disk->atomic = 1;
+        for (y = 0; y != name_n; ++y) {
+                for (x = 0; x != nfiles && files[x].on_disk != names[y]; ++x);
+                if (x == nfiles && !names[y]->is_sys && (!only || in_list(names[y]->name, only))) {
+                        printf("rm %s\n", names[y]->name);
+                        rm(names[y]->name, 0);
+                        ++deleted;
+                }
+        }
+        for (x = 0; x != nfiles; ++x) {
+                if (files[x].same) {
+                        ++unchanged;
+                        continue;
+                }
+                printf("put %s\n", files[x].name);
+                put_data(files[x].data, files[x].size, files[x].name);
+                ++written;
+        }
+        free_host_dir(files, nfiles);
+        free_dir();
 
-                        if (d->flag & FLAG_IN_USE_ED) {
-                                struct name *nam;
-                                char *s = getname(d);
-                                nam = (struct name *)malloc(sizeof(struct name));
-                                nam->name = strdup(s);
-                                if (d->flag & FLAG_LOCKED)
-                                        nam->locked = 1;
-                                else
-                                        nam->locked = 0;
-                                nam->sector = d->start_lo + (d->start_hi * 256);
-                                nam->sects = d->count_lo + (d->count_hi * 256);
-                                nam->segments = 0;
-                                nam->size = -1;
-                                if (info_flg)
-                                        get_info(nam);
+        if (status) {
+                image_discard(disk);
+                fprintf(stderr, "Sync failed, image not changed\n");
+                return -1;
+        }
+        printf("%d written, %d deleted, %d unchanged\n", written, deleted, unchanged);
+        return 0;
+}
 
-                                if (!strcmp(nam->name, "dos.sys") || !strcmp(nam->name, "dup.sys"))
-                                        nam->is_sys = 1;
-                                else
-                                        nam->is_sys = 0;
+/* Keep disk in sync with local directory: sync it, then whenever files in
+   the directory change, sync just those.  Changes are collected until
+   nothing has changed for delay ms, then the image is updated all at once
+   (see do_sync), so anything reading it always sees a whole disk. */
 
-                                if ((all_flg || !nam->is_sys))
-                                        names[name_n++] = nam;
+#define MAX_PENDING 256
+
+int use_disk(struct image *img);
+
+int do_watch(char *dir_name, int delay)
+{
+#ifdef __linux__
+        char *pending[MAX_PENDING + 1];
+        int npending = 0;
+        int full = 0;
+        int fd;
+        char *disk_name = strdup(disk->name);
+
+        if ((fd = inotify_init()) < 0 ||
+            inotify_add_watch(fd, dir_name, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE |
+                                            IN_DELETE_SELF | IN_MOVE_SELF) < 0) {
+                fprintf(stderr, "Couldn't watch '%s'\n", dir_name);
+                return -1;
+        }
+        full = 1;
+        for (;;) {
+                struct pollfd p[1];
+                int n;
+                p->fd = fd;
+                p->events = POLLIN;
+                n = poll(p, 1, (npending || full) ? delay : -1);
+                if (n < 0) {
+                        fprintf(stderr, "Couldn't wait for changes in '%s'\n", dir_name);
+                        return -1;
+                } else if (n) {
+                        /* Something changed: note names, then wait for more */
+                        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+                        long len = read(fd, buf, sizeof(buf));
+                        long ofst;
+                        for (ofst = 0; ofst < len; ) {
+                                struct inotify_event *e = (struct inotify_event *)(buf + ofst);
+                                ofst += sizeof(struct inotify_event) + e->len;
+                                if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                                        fprintf(stderr, "'%s' went away\n", dir_name);
+                                        return -1;
+                                } else if (e->mask & IN_Q_OVERFLOW) {
+                                        full = 1;
+                                } else if (e->len && e->name[0] != '.') {
+                                        int y;
+                                        for (y = 0; y != npending && strcmp(pending[y], e->name); ++y);
+                                        if (y != npending)
+                                                ;
+                                        else if (npending == MAX_PENDING)
+                                                full = 1;
+                                        else
+                                                pending[npending++] = strdup(e->name);
+                                }
                         }
+                } else {
+                        /* Quiet for delay ms: bring image up to date.  It's only
+                           open (and locked) while it's updated, so other atr
+                           processes can use it in between. */
+                        pending[npending] = 0;
+                        if (!disk && (!(disk = image_open(disk_name, 0)) || use_disk(disk)))
+                                return -1;
+                        status = 0;
+                        disk->atomic = 1;
+                        if (do_sync(dir_name, full ? NULL : pending))
+                                image_discard(disk);
+                        image_close(disk);
+                        disk = 0;
+                        fflush(stdout);
+                        while (npending)
+                                free(pending[--npending]);
+                        full = 0;
                 }
         }
-        done:;
+#else
+        (void)dir_name;
+        (void)delay;
+        fprintf(stderr, "watch needs inotify, which is only on Linux\n");
+        return -1;
+#endif
 }
 
 #define FLUSHLINE do { \
@@ -1454,11 +3253,14 @@ void atari_dir(int all, int full, int single)
                         int ofst;
                         int extra = 0;
                         struct segment *seg;
-                        sprintf(linebuf, "-r%c%c%c %6d (%3d) %-13s",
+                        sprintf(linebuf, "-r%c%c%c %6d (%3d) ",
                                (names[x]->locked ? '-' : 'w'),
                                (names[x]->is_cm ? 'x' : '-'),
                                (names[x]->is_sys ? 's' : '-'),
-                               names[x]->size, names[x]->sects, names[x]->name);
+                               names[x]->size, names[x]->sects);
+                        if (ls_drive)
+                                sprintf(linebuf + strlen(linebuf), "%6.2fs ", names[x]->load_time / 1000.0);
+                        sprintf(linebuf + strlen(linebuf), "%-13s", names[x]->name);
                         ofst = strlen(linebuf) + 1;
                         for (seg = names[x]->segments; seg; seg = seg->next) {
                                 if (!extra) {
@@ -1514,132 +3316,729 @@ void atari_dir(int all, int full, int single)
         }
 }
 
-int mkfs(char *disk_name, int type, char* boot_sectors_file_path)
+/* Create empty disk image: type is 1 for single density, 2 for enhanced
+   density, 3 for double density */
+
+int create_disk(char *disk_name, int type)
 {
-        unsigned char hdr[16];
-        unsigned char bf[256];
-        unsigned char bitmap[ED_BITMAP_SIZE];
-        int size;
-        int n;
-        disk = fopen(disk_name, "w+");
-        if (!disk) {
-                fprintf(stderr, "Couldn't open '%s'\n", disk_name);
-                return -1;
-        }
-        /* .ATR header */
-        memset(hdr, 0, 16);
-        hdr[0] = 0x96;
-        hdr[1] = 0x02;
         switch (type) {
                 case 1: {
                         disk_size = SD_DISK_SIZE;
-                        size = 40*18*128;
-                        hdr[2] = size/16;
-                        hdr[3] = size/16/256;
-                        hdr[4] = 0x80;
-                        hdr[5] = 0x00;
+                        disk = image_create(disk_name, NULL, SECTOR_SIZE, 40*18, ATR_LOGICAL);
                         break;
                 } case 2: {
                         disk_size = ED_DISK_SIZE;
-                        size = 40*26*128;
-                        hdr[2] = size/16;
-                        hdr[3] = size/16/256;
-                        hdr[4] = 0x80;
-                        hdr[5] = 0x00;
+                        disk = image_create(disk_name, NULL, SECTOR_SIZE, 40*26, ATR_LOGICAL);
                         break;
                 } case 3: {
                         disk_size = DD_DISK_SIZE;
                         set_density(1);
-                        size = 40*18*256 - 3*128;
-                        hdr[2] = size/16;
-                        hdr[3] = size/16/256;
-                        hdr[4] = 0x00;
-                        hdr[5] = 0x01;
+                        disk = image_create(disk_name, NULL, DD_SECTOR_SIZE, 40*18, ATR_LOGICAL);
                         break;
                 }
         }
-        if (16 != fwrite(hdr, 1, 16, disk)) {
+        if (!disk) {
+                fprintf(stderr, "Couldn't create '%s'\n", disk_name);
+                return -1;
+        }
+        return 0;
+}
+
+int mkfs(char *disk_name, int type, char* boot_sectors_file_path)
+{
+        unsigned char bf[256];
+        unsigned char bitmap[ED_BITMAP_SIZE];
+        int size;
+        int n;
+        if (create_disk(disk_name, type))
+                return -1;
+        memset(bf, 0, 256);
+        /* VTOC */
+        bf[0] = 2;
+        if (disk_size == ED_DISK_SIZE) {
+                bf[1] = (255 & 1010);
+                bf[2] = 1010/256;
+        } else {
+                bf[1] = (255 & 707);
+                bf[2] = 707/256;
+        }
+        putsect(bf, SECTOR_VTOC);
+        memset(bitmap, 0xFF, ED_BITMAP_SIZE);
+        mark_space(bitmap, 0, 1); /* Sector zero */
+        mark_space(bitmap, 1, 1); /* Boot sectors */
+        mark_space(bitmap, 2, 1);
+        mark_space(bitmap, 3, 1);
+        mark_space(bitmap, SECTOR_VTOC, 1); /* VTOC */
+        for (n = 0; n != SECTOR_DIR_SIZE; ++n) /* DIR */
+                mark_space(bitmap, SECTOR_DIR + n, 1);
+        mark_space(bitmap, 720, 1); /* Reserved */
+        putmap(bitmap);
+        if (boot_sectors_file_path != NULL) {
+                FILE* boot_sectors_file = fopen(boot_sectors_file_path, "rb");
+                if (!boot_sectors_file) {
+                        fprintf(stderr, "Couldn't open '%s'\n", boot_sectors_file_path);
+                        return -1;
+                }
+                n=0;
+                while (n++, !feof(boot_sectors_file)) {
+                        size = ( n < 3 ? SECTOR_SIZE : sector_size);
+                        size = fread(bf, size, 1, boot_sectors_file);
+                        putsect(bf, n);
+                }
+                fclose(boot_sectors_file);
+        }
+        n = image_close(disk);
+        disk = 0;
+        if (n) {
+                fprintf(stderr, "Couldn't write to '%s'\n", disk_name);
+                return -1;
+        }
+        return 0;
+}
+
+/* Boot loader for mkboot.  The OS reads boot sectors 1..3 into $0700 and
+ * calls $0706.  The loader reads the program from consecutive sectors
+ * starting at 4, one sector at a time into $0400, and loads it like DOS
+ * does: after each segment it calls INITAD, at the end it jumps to RUNAD.
+ * mkboot patches in the sector size and program length.
+ *
+ *         .byte 0, 3              ; Flags, no. boot sectors
+ *         .word $0700             ; Load address
+ *         .word rtsx              ; DOSINI
+ *         jmp start
+ * dcb     .byte $31, 1, $52, $40  ; Device, unit, read, data from drive
+ *         .word $0400             ; Buffer
+ *         .byte 7, 0              ; Timeout
+ *         .word 128               ; Sector size (patched)
+ *         .word 4                 ; Next sector
+ * left    .byte 0, 0, 0           ; Bytes of program left (patched)
+ * ssize   .byte $80               ; Sector size, 0 for 256 (patched)
+ * bidx    .byte 0                 ; Next byte in buffer, 0 if it's empty
+ * endp    .word 0                 ; Last address of segment
+ * start   lda #<rtsx              ; Nothing to run if there's no RUNAD
+ *         sta $2e0
+ *         lda #>rtsx
+ *         sta $2e1
+ * seg     jsr getb                ; Start address, skipping $FFFF
+ *         bcs done
+ *         sta $43
+ *         jsr getb
+ *         sta $44
+ *         and $43
+ *         cmp #$ff
+ *         beq seg
+ *         jsr getb                ; End address
+ *         sta endp
+ *         jsr getb
+ *         sta endp+1
+ *         lda #<rtsx              ; Nothing to init unless segment sets it
+ *         sta $2e2
+ *         lda #>rtsx
+ *         sta $2e3
+ * copy    jsr getb
+ *         ldy #0
+ *         sta ($43),y
+ *         lda $43                 ; Carry set if that was the last one
+ *         cmp endp
+ *         lda $44
+ *         sbc endp+1
+ *         inc $43
+ *         bne c1
+ *         inc $44
+ * c1      bcc copy
+ *         jsr doinit
+ *         jmp seg
+ * doinit  jmp ($2e2)
+ * done    jmp ($2e0)
+ * rtsx    clc
+ *         rts
+ * getb    lda left                ; Get next byte, carry set at end
+ *         ora left+1
+ *         ora left+2
+ *         bne g1
+ *         sec
+ *         rts
+ * g1      lda left
+ *         bne g2
+ *         lda left+1
+ *         bne g3
+ *         dec left+2
+ * g3      dec left+1
+ * g2      dec left
+ *         ldx bidx
+ *         bne g4
+ *         jsr read
+ *         ldx #0
+ * g4      lda $400,x
+ *         inx
+ *         cpx ssize
+ *         bne g5
+ *         ldx #0
+ * g5      stx bidx
+ *         clc
+ *         rts
+ * read    ldx #11                 ; Read next sector, retry until it works
+ * r1      lda dcb,x
+ *         sta $300,x
+ *         dex
+ *         bpl r1
+ *         jsr $e459
+ *         bmi read
+ *         inc dcb+10
+ *         bne r2
+ *         inc dcb+11
+ * r2      rts
+ */
+
+unsigned char boot_loader[] = {
+        0x00, 0x03, 0x00, 0x07, 0x73, 0x07, 0x4C, 0x1C, 0x07, 0x31, 0x01, 0x52,
+        0x40, 0x00, 0x04, 0x07, 0x00, 0x80, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
+        0x80, 0x00, 0x00, 0x00, 0xA9, 0x73, 0x8D, 0xE0, 0x02, 0xA9, 0x07, 0x8D,
+        0xE1, 0x02, 0x20, 0x75, 0x07, 0xB0, 0x45, 0x85, 0x43, 0x20, 0x75, 0x07,
+        0x85, 0x44, 0x25, 0x43, 0xC9, 0xFF, 0xF0, 0xEE, 0x20, 0x75, 0x07, 0x8D,
+        0x1A, 0x07, 0x20, 0x75, 0x07, 0x8D, 0x1B, 0x07, 0xA9, 0x73, 0x8D, 0xE2,
+        0x02, 0xA9, 0x07, 0x8D, 0xE3, 0x02, 0x20, 0x75, 0x07, 0xA0, 0x00, 0x91,
+        0x43, 0xA5, 0x43, 0xCD, 0x1A, 0x07, 0xA5, 0x44, 0xED, 0x1B, 0x07, 0xE6,
+        0x43, 0xD0, 0x02, 0xE6, 0x44, 0x90, 0xE7, 0x20, 0x6D, 0x07, 0x4C, 0x26,
+        0x07, 0x6C, 0xE2, 0x02, 0x6C, 0xE0, 0x02, 0x18, 0x60, 0xAD, 0x15, 0x07,
+        0x0D, 0x16, 0x07, 0x0D, 0x17, 0x07, 0xD0, 0x02, 0x38, 0x60, 0xAD, 0x15,
+        0x07, 0xD0, 0x0B, 0xAD, 0x16, 0x07, 0xD0, 0x03, 0xCE, 0x17, 0x07, 0xCE,
+        0x16, 0x07, 0xCE, 0x15, 0x07, 0xAE, 0x19, 0x07, 0xD0, 0x05, 0x20, 0xAF,
+        0x07, 0xA2, 0x00, 0xBD, 0x00, 0x04, 0xE8, 0xEC, 0x18, 0x07, 0xD0, 0x02,
+        0xA2, 0x00, 0x8E, 0x19, 0x07, 0x18, 0x60, 0xA2, 0x0B, 0xBD, 0x09, 0x07,
+        0x9D, 0x00, 0x03, 0xCA, 0x10, 0xF7, 0x20, 0x59, 0xE4, 0x30, 0xF0, 0xEE,
+        0x13, 0x07, 0xD0, 0x03, 0xEE, 0x14, 0x07, 0x60
+};
+
+/* Offsets of patched bytes in boot_loader */
+#define LOADER_BYTES 0x11 /* dcb sector size */
+#define LOADER_LEFT 0x15
+#define LOADER_SSIZE 0x18
+
+/* Memory the loader uses: a program can't load over it */
+struct { int start, end; } loader_mem[] = {
+        { 0x43, 0x44 }, /* Pointer */
+        { 0x300, 0x30B }, /* Device control block for SIO */
+        { 0x400, 0x4FF }, /* Sector buffer */
+        { 0x700, 0x87F }, /* Boot sectors */
+        { 0, 0 }
+};
+
+/* Make a disk which boots straight into a binary program.  type is as for
+   create_disk(), or 0 to pick the smallest disk the program fits on. */
+
+int mkboot(char *prog_name, char *disk_name, int type)
+{
+        unsigned char *buf;
+        unsigned char *membuf;
+        unsigned char bf[DD_SECTOR_SIZE];
+        struct segment *segments, *seg;
+        long size;
+        long ofst;
+        int has_start = 0;
+        int sect;
+        int x;
+
+        if (!(buf = read_local(prog_name, &size)))
+                return -1;
+
+        /* Check that it's a good binary file which stays out of the loader's way */
+        membuf = (unsigned char *)malloc(65536);
+        x = load_segments(buf, size, membuf, &segments);
+        free(membuf);
+        if (x || !segments) {
+                fprintf(stderr, "'%s' is not a binary load file, or it's damaged\n", prog_name);
+                free(buf);
+                return -1;
+        }
+        for (seg = segments; seg; seg = seg->next) {
+                int y;
+                for (y = 0; loader_mem[y].end; ++y)
+                        if (seg->start <= loader_mem[y].end && seg->start + seg->size - 1 >= loader_mem[y].start) {
+                                fprintf(stderr, "Segment $%4.4X-$%4.4X of '%s' overlaps the boot loader at $%4.4X-$%4.4X\n",
+                                        seg->start, seg->start + seg->size - 1, prog_name, loader_mem[y].start, loader_mem[y].end);
+                                status = 1;
+                        }
+                if (seg->init != -1 || seg->run != -1)
+                        has_start = 1;
+        }
+        if (status) {
+                free(buf);
+                return -1;
+        }
+        if (!has_start)
+                fprintf(stderr, "Warning: '%s' has no run or init address\n", prog_name);
+
+        /* Smallest disk it fits on */
+        if (!type) {
+                if (size <= (long)SECTOR_SIZE * (SD_DISK_SIZE - 3))
+                        type = 1;
+                else if (size <= (long)SECTOR_SIZE * (40 * 26 - 3))
+                        type = 2;
+                else
+                        type = 3;
+        }
+        if (create_disk(disk_name, type)) {
+                free(buf);
+                return -1;
+        }
+        if (size > (long)sector_size * (disk->nsects - 3)) {
+                fprintf(stderr, "'%s' is too big: only %ld bytes fit\n", prog_name, (long)sector_size * (disk->nsects - 3));
+                image_close(disk);
+                disk = 0;
+                remove(disk_name);
+                free(buf);
+                return -1;
+        }
+
+        /* Boot sectors */
+        boot_loader[LOADER_BYTES] = sector_size;
+        boot_loader[LOADER_BYTES + 1] = (sector_size >> 8);
+        boot_loader[LOADER_LEFT] = size;
+        boot_loader[LOADER_LEFT + 1] = (size >> 8);
+        boot_loader[LOADER_LEFT + 2] = (size >> 16);
+        boot_loader[LOADER_SSIZE] = sector_size; /* 0 for 256 */
+        for (sect = 1; sect <= 3; ++sect) {
+                memset(bf, 0, sizeof(bf));
+                for (x = 0; x != SECTOR_SIZE; ++x)
+                        if ((sect - 1) * SECTOR_SIZE + x < (int)sizeof(boot_loader))
+                                bf[x] = boot_loader[(sect - 1) * SECTOR_SIZE + x];
+                putsect(bf, sect);
+        }
+
+        /* Program: all of each sector, no link bytes */
+        for (ofst = 0, sect = 4; ofst < size; ofst += sector_size, ++sect) {
+                memset(bf, 0, sizeof(bf));
+                memcpy(bf, buf + ofst, (size - ofst < sector_size ? size - ofst : sector_size));
+                putsect(bf, sect);
+        }
+        free(buf);
+
+        printf("%s: %ld bytes in sectors 4 - %d\n", disk_name, size, sect - 1);
+
+        x = image_close(disk);
+        disk = 0;
+        if (x) {
                 fprintf(stderr, "Couldn't write to '%s'\n", disk_name);
                 return -1;
         }
-        memset(bf, 0, 256);
-        for (n = 0; n != size; n += 128) {
-                if (128 != fwrite(bf, 1, 128, disk)) {
-                        fprintf(stderr, "Couldn't write to '%s'\n", disk_name);
-                        return -1;
-                }
+        return 0;
+}
+
+int should_extract(char* filename, int list_start, int argc, char* argv[])
+{
+    int i;
+    if (!list_start) {
+        return 1;   //  no list
+    }
+    for (i = list_start; i < argc; ++i) {
+        if(!strcmp(filename, argv[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* True if command at argv[x] modifies the disk */
+
+int is_write_cmd(int argc, char *argv[], int x)
+{
+        char *cmd;
+        if (x == argc)
+                return 0;
+        cmd = argv[x];
+        /* Dry run only reads */
+        if (!strcmp(cmd, "scrub"))
+                return !(x + 1 != argc && !strcmp(argv[x + 1], "-n"));
+        return !strcmp(cmd, "put") || !strcmp(cmd, "w") || !strcmp(cmd, "mv") ||
+               !strcmp(cmd, "rm") || !strcmp(cmd, "fix") || !strcmp(cmd, "patch") ||
+               !strcmp(cmd, "defrag") || !strcmp(cmd, "optimize") || !strcmp(cmd, "sync") ||
+               !strcmp(cmd, "watch") || !strcmp(cmd, "restore") ||
+               !strcmp(cmd, "canonicalize");
+}
+
+void close_disk(void);
+int command(int argc, char *argv[], int x);
+int zip_command(char *zip_name, int argc, char *argv[], int x);
+int each_command(char **images, int n, int argc, char *argv[], int x);
+int hash_command(char **images, int n);
+int grep_command(char *pat, int mode, char **images, int n);
+
+/* Start using an open disk image: determine its density */
+
+int use_disk(struct image *img)
+{
+        disk = img;
+        status = 0;
+        name_n = 0; /* Forget directory of previous disk */
+
+        if (disk->sec_size == SECTOR_SIZE && disk->nsects < ED_DISK_SIZE) {
+                /* Minimum size for enhanced density is 1024 sectors */
+                /* Anything less: assume single-density */
+                /* printf("Single density DOS 2.0S disk assumed\n"); */
+                disk_size = SD_DISK_SIZE;
+                set_density(0);
+        } else if (disk->sec_size == SECTOR_SIZE) {
+                /* printf("Enhanced density DOS 2.5 disk assumed\n"); */
+                disk_size = ED_DISK_SIZE;
+                set_density(0);
+        } else if (disk->sec_size == DD_SECTOR_SIZE && disk->nsects >= DD_DISK_SIZE) {
+                disk_size = DD_DISK_SIZE;
+                set_density(1);
+                /* printf("Double density DOS 2.0D disk assumed\n"); */
+        } else {
+                printf("Unknown disk size.  Expected:\n");
+                printf("  720 128 byte sectors for DOS 2.0s single density\n");
+                printf("  1040 128 byte sectors for DOS 2.5 enhanced density\n");
+                printf("  720 256 byte sectors for DOS 2.0d double density\n");
+                return -1;
+        }
+        return 0;
+}
+
+/* Result cache: the output of commands which only look at the disk (ls and
+ * check) is saved in a directory, keyed by a hash of the image contents and
+ * the command line.  When the same command is run on an image with the
+ * same contents, the saved output and exit status are given instead of
+ * reading the filesystem.  Standard output and standard error are both
+ * saved (check gives its complaints on standard error), and are given back
+ * one after the other.
+ *
+ * Hashing the image still means reading it, so for each image file we
+ * also remember its size, modification time and inode along with its hash.
+ * If none of these have changed, the image isn't even opened.
+ *
+ * The directory holds two kinds of files: i<device>-<inode> with the
+ * file's size, time and hash, and r<image hash>-<command hash> with the
+ * exit status and the length of the standard output on the first line,
+ * followed by the standard output and then the standard error output.
+ */
+
+char *cache_dir; /* Cache directory, NULL if there is no cache */
+int cache_recheck; /* Set to ignore saved results (they are saved again) */
+
+/* Check if command only looks at the disk, so its result can be saved */
+
+int cacheable(int argc, char *argv[], int x)
+{
+        while (x != argc && argv[x][0] == '-')
+                x += (!strcmp(argv[x], "--drive") && x + 1 != argc) ? 2 : 1;
+        return x == argc || !strcmp(argv[x], "ls") || !strcmp(argv[x], "check");
+}
+
+/* Hash of command line, so ls -l and check results are kept apart */
+
+unsigned long long command_hash(int argc, char *argv[], int x)
+{
+        unsigned long long h = fnv_hash(FNV_INIT, (unsigned char *)"atr2", 4);
+        for (; x != argc; ++x)
+                h = fnv_hash(h, (unsigned char *)argv[x], strlen(argv[x]) + 1);
+        return h;
+}
+
+/* Write cache file: it's written under a temporary name and renamed, so
+   other processes never see part of one */
+
+void cache_write(char *name, char *head, unsigned char *data, long len)
+{
+        char *tmp = (char *)malloc(strlen(name) + 20);
+        FILE *f;
+#ifdef HAVE_FLOCK
+        sprintf(tmp, "%s.%d", name, (int)getpid());
+#else
+        /* No locks: there's only one atr at a time */
+        sprintf(tmp, "%s.tmp", name);
+#endif
+        if ((f = fopen(tmp, "wb"))) {
+                if (fputs(head, f) < 0 || (len && 1 != fwrite(data, len, 1, f)) || fclose(f) || rename(tmp, name))
+                        remove(tmp);
+        }
+        free(tmp);
+}
+
+char *cache_name(char *fmt, unsigned long long a, unsigned long long b)
+{
+        char *name = (char *)malloc(strlen(cache_dir) + 40);
+        sprintf(name, fmt, cache_dir, a, b);
+        return name;
+}
+
+/* Get hash of image file with stat st if it hasn't changed since we last
+   hashed it.  Returns non-zero if we don't know. */
+
+int cache_stat_hash(struct stat *st, unsigned long long *h)
+{
+        char *name = cache_name("%s/i%llx-%llx", st->st_dev, st->st_ino);
+        long long size, sec, nsec;
+        int rtn = -1;
+        FILE *f = fopen(name, "r");
+        if (f) {
+                if (4 == fscanf(f, "%lld %lld %lld %llx", &size, &sec, &nsec, h) &&
+                    size == (long long)st->st_size && sec == (long long)st->st_mtim.tv_sec &&
+                    nsec == (long long)st->st_mtim.tv_nsec)
+                        rtn = 0;
+                fclose(f);
+        }
+        free(name);
+        return rtn;
+}
+
+void cache_save_stat(struct stat *st, unsigned long long h)
+{
+        char *name = cache_name("%s/i%llx-%llx", st->st_dev, st->st_ino);
+        char buf[100];
+        sprintf(buf, "%lld %lld %lld %llx\n", (long long)st->st_size, (long long)st->st_mtim.tv_sec,
+                (long long)st->st_mtim.tv_nsec, h);
+        cache_write(name, buf, NULL, 0);
+        free(name);
+}
+
+/* Print saved result: returns non-zero if there isn't one */
+
+int cache_print(unsigned long long img_hash, unsigned long long cmd_hash, int *rtn)
+{
+        char *name = cache_name("%s/r%016llx-%016llx", img_hash, cmd_hash);
+        char buf[4096];
+        long out_len;
+        size_t len;
+        FILE *f = fopen(name, "rb");
+        free(name);
+        if (!f)
+                return -1;
+        if (2 != fscanf(f, "status %d %ld", rtn, &out_len) || fgetc(f) != '\n' || out_len < 0) {
+                fclose(f);
+                return -1;
+        }
+        while (out_len && (len = fread(buf, 1, out_len < (long)sizeof(buf) ? out_len : (long)sizeof(buf), f))) {
+                fwrite(buf, 1, len, stdout);
+                out_len -= len;
         }
-        /* VTOC */
-        bf[0] = 2;
-        if (disk_size == ED_DISK_SIZE) {
-                bf[1] = (255 & 1010);
-                bf[2] = 1010/256;
-        } else {
-                bf[1] = (255 & 707);
-                bf[2] = 707/256;
+        fflush(stdout);
+        while ((len = fread(buf, 1, sizeof(buf), f)))
+                fwrite(buf, 1, len, stderr);
+        fclose(f);
+        return 0;
+}
+
+/* While a command runs, its standard output and standard error each go
+   to a temporary file */
+
+FILE *capture_file[2];
+int capture_fd[2] = { -1, -1 }; /* Where they really go */
+
+/* Stop capturing one stream: returns what was captured in a malloc block */
+
+unsigned char *end_capture_fd(int i, long *len)
+{
+        unsigned char *buf;
+#ifdef HAVE_DUP2
+        dup2(capture_fd[i], i + 1);
+        close(capture_fd[i]);
+#endif
+        capture_fd[i] = -1;
+        *len = ftell(capture_file[i]);
+        rewind(capture_file[i]);
+        buf = (unsigned char *)malloc(*len + 1);
+        if (*len < 0 || (*len && 1 != fread(buf, *len, 1, capture_file[i]))) {
+                free(buf);
+                buf = 0;
         }
-        putsect(bf, SECTOR_VTOC);
-        memset(bitmap, 0xFF, ED_BITMAP_SIZE);
-        mark_space(bitmap, 0, 1); /* Sector zero */
-        mark_space(bitmap, 1, 1); /* Boot sectors */
-        mark_space(bitmap, 2, 1);
-        mark_space(bitmap, 3, 1);
-        mark_space(bitmap, SECTOR_VTOC, 1); /* VTOC */
-        for (n = 0; n != SECTOR_DIR_SIZE; ++n) /* DIR */
-                mark_space(bitmap, SECTOR_DIR + n, 1);
-        mark_space(bitmap, 720, 1); /* Reserved */
-        putmap(bitmap);
-        if (boot_sectors_file_path != NULL) {
-                FILE* boot_sectors_file = fopen(boot_sectors_file_path, "rb");
-                if (!boot_sectors_file) {
-                        fprintf(stderr, "Couldn't open '%s'\n", boot_sectors_file_path);
+        fclose(capture_file[i]);
+        return buf;
+}
+
+int start_capture(void)
+{
+#ifdef HAVE_DUP2
+        int i;
+        fflush(stdout);
+        fflush(stderr);
+        for (i = 0; i != 2; ++i) {
+                if (!(capture_file[i] = tmpfile()) || (capture_fd[i] = dup(i + 1)) == -1 ||
+                    dup2(fileno(capture_file[i]), i + 1) == -1) {
+                        long len;
+                        if (capture_fd[i] != -1)
+                                close(capture_fd[i]);
+                        capture_fd[i] = -1;
+                        if (capture_file[i])
+                                fclose(capture_file[i]);
+                        if (i)
+                                free(end_capture_fd(0, &len));
                         return -1;
                 }
-                n=0;
-                while (n++, !feof(boot_sectors_file)) {
-                        size = ( n < 3 ? SECTOR_SIZE : sector_size);
-                        size = fread(bf, size, 1, boot_sectors_file);
-                        putsect(bf, n);
-                }
-                fclose(boot_sectors_file);
         }
-        fclose(disk);
         return 0;
+#else
+        /* Can't capture: commands just aren't cached */
+        return -1;
+#endif
 }
 
-int should_extract(char* filename, int list_start, int argc, char* argv[])
+/* Stop capturing, and print what was captured.  Returns it in a malloc
+   block: *len bytes of standard output followed by *err_len bytes of
+   standard error.  This is also called at exit() in case the command
+   exits. */
+
+unsigned char *end_capture(long *len, long *err_len)
 {
-    int i;
-    if (!list_start) {
-        return 1;   //  no list
-    }
-    for (i = list_start; i < argc; ++i) {
-        if(!strcmp(filename, argv[i])) {
-            return 1;
+        unsigned char *out, *err;
+        unsigned char *buf = 0;
+        if (capture_fd[0] == -1)
+                return 0;
+        fflush(stdout);
+        fflush(stderr);
+        out = end_capture_fd(0, len);
+        err = end_capture_fd(1, err_len);
+        if (out)
+                fwrite(out, 1, *len, stdout);
+        fflush(stdout);
+        if (err)
+                fwrite(err, 1, *err_len, stderr);
+        if (out && err) {
+                buf = (unsigned char *)malloc(*len + *err_len + 1);
+                memcpy(buf, out, *len);
+                memcpy(buf + *len, err, *err_len);
         }
-    }
-    return 0;
+        free(out);
+        free(err);
+        return buf;
+}
+
+void abort_capture(void)
+{
+        long len, err_len;
+        free(end_capture(&len, &err_len));
+}
+
+/* Run command on disk, or give its saved result.  img_hash is the hash of
+   the image contents. */
+
+int cached_command(unsigned long long img_hash, int argc, char *argv[], int x)
+{
+        unsigned long long cmd_hash = command_hash(argc, argv, x);
+        unsigned char *out;
+        long len, err_len;
+        int rtn;
+
+        if (!cache_recheck && !cache_print(img_hash, cmd_hash, &rtn))
+                return rtn;
+
+        if (start_capture())
+                return command(argc, argv, x);
+        rtn = command(argc, argv, x);
+        if ((out = end_capture(&len, &err_len))) {
+                char *name = cache_name("%s/r%016llx-%016llx", img_hash, cmd_hash);
+                char head[60];
+                sprintf(head, "status %d %ld\n", rtn, len);
+                cache_write(name, head, out, len + err_len);
+                free(name);
+                free(out);
+        }
+        return rtn;
+}
+
+/* Hash of open disk's contents */
+
+unsigned long long disk_hash(void)
+{
+        return fnv_hash(FNV_INIT, disk->raw, disk->size);
+}
+
+/* Cached command on image file: try to get the result without opening it */
+
+int cached_file_command(char *disk_name, int argc, char *argv[], int x)
+{
+        struct stat st;
+        unsigned long long h;
+        int rtn;
+#ifdef HAVE_FLOCK
+        /* Hold shared lock, so image doesn't change while we look */
+        int fd = image_lock(disk_name, 0);
+        int got = fd >= 0 && !fstat(fd, &st);
+#else
+        int got = !stat(disk_name, &st);
+#endif
+
+        if (got && !cache_recheck && !cache_stat_hash(&st, &h) &&
+            !cache_print(h, command_hash(argc, argv, x), &rtn)) {
+#ifdef HAVE_FLOCK
+                close(fd);
+#endif
+                return rtn;
+        }
+#ifdef HAVE_FLOCK
+        if (fd >= 0)
+                close(fd);
+#endif
+
+        if (!(disk = image_open(disk_name, 1)))
+                return -1;
+        if (use_disk(disk))
+                return -1;
+        h = disk_hash();
+        if (disk->lock_fd >= 0 ? !fstat(disk->lock_fd, &st) : !stat(disk_name, &st))
+                cache_save_stat(&st, h);
+        rtn = cached_command(h, argc, argv, x);
+        image_close(disk);
+        disk = 0;
+        return rtn;
 }
 
 int main(int argc, char *argv[])
 {
-        int all = 0;
-        int full = 0;
-        int single = 0;
-        long size;
         int x;
         char *disk_name;
         x = 1;
+        cache_dir = getenv("ATR_CACHE");
+        for (;;) {
+                if (x != argc && !strcmp(argv[x], "--no-wait")) {
+                        image_lock_wait = 0;
+                        ++x;
+                } else if (x + 1 < argc && !strcmp(argv[x], "--wait")) {
+                        image_lock_wait = atoi(argv[x + 1]);
+                        x += 2;
+                } else if (x + 1 < argc && !strcmp(argv[x], "--cache")) {
+                        cache_dir = argv[x + 1];
+                        x += 2;
+                } else if (x != argc && !strcmp(argv[x], "--no-cache")) {
+                        cache_dir = 0;
+                        ++x;
+                } else if (x != argc && !strcmp(argv[x], "--recheck")) {
+                        cache_recheck = 1;
+                        ++x;
+                } else {
+                        break;
+                }
+        }
+        if (cache_dir && !*cache_dir)
+                cache_dir = 0;
+        if (cache_dir)
+                mkdir(cache_dir, 0777);
         if (x == argc || !strcmp(argv[x], "--help") || !strcmp(argv[x], "-h")) {
                 printf("\nAtari DOS 2.0s, DOS 2.0d and DOS 2.5 diskette access\n");
                 printf("\n");
-                printf("Syntax: atr path-to-diskette [command] [args]\n");
+                printf("Syntax: atr [--wait secs|--no-wait] path-to-diskette [command] [args]\n");
+                printf("\n");
+                printf("  The image is locked while atr uses it: commands which only read it share\n");
+                printf("  it, others have to wait their turn.  atr waits up to 30 seconds for a\n");
+                printf("  lock (--wait -1 waits forever), or fails right away with --no-wait.\n");
+                printf("\n");
+                printf("  --cache dir saves the output of ls and check in dir (or set ATR_CACHE).\n");
+                printf("  It's given again without reading the filesystem if the image hasn't\n");
+                printf("  changed.  --recheck runs them anyway, --no-cache doesn't use the cache.\n");
+                printf("\n");
+                printf("  Diskette can be a .atr, .xfd, .dcm or .imd image (optionally .gz or .zst\n");
+                printf("  compressed), or archive.zip:path/inside.atr for an image in a .zip archive.\n");
+                printf("  If it's just archive.zip, the command is run on every image in the archive.\n");
                 printf("\n");
                 printf("  Commands: (with no command, ls is assumed)\n\n");
                 printf("      ls [-la1]                    Directory listing\n");
                 printf("                  -l for long\n");
                 printf("                  -a to show system files\n");
-                printf("                  -1 to show a single name per line\n\n");
+                printf("                  -1 to show a single name per line\n");
+                printf("                  -t to show estimated load time (with -l)\n");
+                printf("                  --drive 810|1050|1050-hs|xf551|xf551-hs\n");
+                printf("                     drive to estimate for (1050 is default)\n\n");
                 printf("      cat [-l] atari-name           Type file to console\n");
                 printf("                  -l to convert line ending from 0x9b to 0x0a\n\n");
                 printf("      get [-l] atari-name [local-name]\n");
@@ -1658,14 +4057,131 @@ int main(int argc, char *argv[])
                 printf("      mv old-name new-name          Rename a file\n\n");
                 printf("      rm atari-name                 Delete a file\n\n");
                 printf("      check                         Check filesystem (read only)\n\n");
+                printf("      diff new-image [patch-file]   List sectors which differ from new-image,\n");
+                printf("                                    with the file each belongs to.  Write\n");
+                printf("                                    them to patch-file if given.\n\n");
+                printf("      patch patch-file              Apply patch-file written by diff\n\n");
+                printf("      sync local-dir                Make disk hold the same files as\n");
+                printf("                                    local-dir: only changed files are\n");
+                printf("                                    written (dos.sys and dup.sys are\n");
+                printf("                                    never deleted)\n\n");
+                printf("      watch [--delay ms] local-dir  Sync, then stay and sync again\n");
+                printf("                                    whenever local-dir changes\n\n");
+                printf("      snapshot atari-name [local-name]\n");
+                printf("                                    Write 64K memory image of binary file\n");
+                printf("                                    after it's loaded (to name.mem), print\n");
+                printf("                                    its init and run addresses\n\n");
+                printf("      recover [-x] [-o dir] [numbers...]\n");
+                printf("                                    List deleted files and lost chains of\n");
+                printf("                                    sectors, most likely first.  -x\n");
+                printf("                                    extracts them (all, or the numbered\n");
+                printf("                                    ones), to dir with -o\n\n");
+                printf("      restore number [atari-name]   Put file found by recover back on the\n");
+                printf("                                    disk\n\n");
+                printf("      scrub [-n]                    Zero free sectors and unused ends of\n");
+                printf("                                    file sectors.  -n: just print how\n");
+                printf("                                    many bytes would change\n\n");
+                printf("      hash                          Print hash of each file's contents,\n");
+                printf("                                    and of the whole filesystem (which\n");
+                printf("                                    ignores free space and layout)\n\n");
+                printf("      canonicalize                  Rewrite disk so that disks with the\n");
+                printf("                                    same files are the same: files in\n");
+                printf("                                    name order, deleted entries dropped,\n");
+                printf("                                    then scrubbed\n\n");
+                printf("      defrag [names...]             Rewrite files in consecutive sectors,\n");
+                printf("                                    named files first\n\n");
+                printf("      optimize [--drive name] names...\n");
+                printf("                                    Place named files where they load\n");
+                printf("                                    fastest on the drive, defrag the rest\n\n");
                 printf("      fix                           Check and fix filesystem (prompts\n");
                 printf("                                    for each fix).\n\n");
                 printf("      mkfs dos2.0s|dos2.0d|dos2.5 [file with boot sectors]\n");
                 printf("                                    Write a new filesystem\n");
+                printf("\n");
+                printf("Syntax: atr mkboot program.xex disk.atr [dos2.0s|dos2.0d|dos2.5]\n");
+                printf("\n");
+                printf("  Make a disk without DOS which boots straight into program.xex.  The\n");
+                printf("  disk is the smallest one the program fits on unless a format is given.\n");
+                printf("\n");
+                printf("Syntax: atr each images... -- [command] [args]\n");
+                printf("\n");
+                printf("  Run a command which doesn't change the disk on each image.  Many images\n");
+                printf("  are read at once, so this is much faster than running atr on each.\n");
+                printf("\n");
+                printf("Syntax: atr hash images...\n");
+                printf("\n");
+                printf("  List files with the same contents, and images with the same files, in\n");
+                printf("  all of the images (see the hash command).\n");
+                printf("\n");
+                printf("Syntax: atr grep [-n|-l] pattern images...\n");
+                printf("\n");
+                printf("  Search the files in the images for pattern (a plain string), print\n");
+                printf("  image:file:offset of each match.  -n prints the line (up to ATASCII\n");
+                printf("  EOL) with the match after it.  -l prints just image:file of each\n");
+                printf("  file with a match.\n");
                 return -1;
         }
         disk_name = argv[x++];
 
+        if (!strcmp(disk_name, "mkboot")) {
+                /* Create a boot disk for a program */
+                int type = 0;
+                if (x + 2 > argc) {
+                        fprintf(stderr, "Syntax: atr mkboot program.xex disk.atr [dos2.0s|dos2.5|dos2.0d]\n");
+                        return -1;
+                }
+                if (x + 2 == argc)
+                        type = 0;
+                else if (!strcmp(argv[x + 2], "dos2.0s"))
+                        type = 1;
+                else if (!strcmp(argv[x + 2], "dos2.5"))
+                        type = 2;
+                else if (!strcmp(argv[x + 2], "dos2.0d"))
+                        type = 3;
+                else {
+                        fprintf(stderr, "Unknown format\n");
+                        return -1;
+                }
+                return mkboot(argv[x], argv[x + 1], type);
+        }
+
+        if (!strcmp(disk_name, "each")) {
+                /* Run command on many disk images */
+                int y;
+                for (y = x; y != argc && strcmp(argv[y], "--"); ++y);
+                if (y == argc || y == x) {
+                        fprintf(stderr, "Syntax: atr each images... -- [command] [args]\n");
+                        return -1;
+                }
+                return each_command(argv + x, y - x, argc, argv, y + 1);
+        }
+
+        if (!strcmp(disk_name, "hash")) {
+                /* Find duplicates in many disk images */
+                if (x == argc) {
+                        fprintf(stderr, "Syntax: atr hash images...\n");
+                        return -1;
+                }
+                return hash_command(argv + x, argc - x);
+        }
+
+        if (!strcmp(disk_name, "grep")) {
+                /* Search files in many disk images */
+                int mode = 0;
+                if (x != argc && !strcmp(argv[x], "-n")) {
+                        mode = GREP_LINES;
+                        ++x;
+                } else if (x != argc && !strcmp(argv[x], "-l")) {
+                        mode = GREP_FILES;
+                        ++x;
+                }
+                if (x + 2 > argc || !argv[x][0]) {
+                        fprintf(stderr, "Syntax: atr grep [-n|-l] pattern images...\n");
+                        return -1;
+                }
+                return grep_command(argv[x], mode, argv + x + 1, argc - x - 1);
+        }
+
         if (argv[x] && !strcmp(argv[x], "mkfs")) {
                 /* Create a filesystem */
                 int type = 0;
@@ -1688,54 +4204,306 @@ int main(int argc, char *argv[])
                 return mkfs(disk_name, type, boot_sectors_file_path);
         }
 
-        /* Open disk image */
-        disk = fopen(disk_name, "r+");
+        /* Every disk image in a .zip archive */
+        if (zip_name(disk_name))
+                return zip_command(disk_name, argc, argv, x);
+
+        if (cache_dir && cacheable(argc, argv, x)) {
+                atexit(abort_capture);
+                return cached_file_command(disk_name, argc, argv, x);
+        }
+
+        /* Open disk image: only commands which change it need write access */
+        disk = image_open(disk_name, !(is_write_cmd(argc, argv, x)));
         if (!disk) {
-                fprintf(stderr, "Couldn't open '%s'\n", disk_name);
                 return -1;
         }
+        atexit(close_disk);
+        if (use_disk(disk))
+                return -1;
 
-        /* Determine image type */
-        if (fseek(disk, 0, SEEK_END)) {
-                fprintf(stderr, "Couldn't seek disk?\n");
+        if (disk->rdonly && is_write_cmd(argc, argv, x)) {
+                char *path;
+                char *arc = zip_split(disk_name, &path);
+                if (arc)
+                        fprintf(stderr, "'%s' is in a .zip archive, which is read only\n", disk_name);
+                else
+                        fprintf(stderr, "'%s' is a %s image, which is read only\n", disk_name, disk->fmt->name);
                 return -1;
         }
-        size = ftell(disk);
-//	if (size - 16 == 40 * 18 * 128) {
-        if (size - 16 < 1024 * 128) {
-                /* Minimum size for enhanced density is 1024 sectors */
-                /* Anything less: assume single-density */
-                /* printf("Single density DOS 2.0S disk assumed\n"); */
-                disk_size = SD_DISK_SIZE;
-//	} else if (size - 16 == 40 * 26 * 128) {
-        } else if (size - 16 < 128*3 + 256*717) {
-                /* Minimum size of double density is 3 128 byte sectors + 717 256 byte sectors */
-                /* Anything less: assume enhanced density */
-                /* printf("Enhanced density DOS 2.5 disk assumed\n"); */
-                disk_size = ED_DISK_SIZE;
-        } else if (size - 16 == 128*3 + 256*717) {
-                disk_size = SD_DISK_SIZE;
-                set_density(1);
-                /* printf("Double density DOS 2.0D disk assumed\n"); */
-        } else {
-                printf("Unknown disk size.  Expected:\n");
-                printf("  .ATR header is 16 bytes, so:\n");
-                printf("  16 + 40*18*128 = 92,176 bytes for DOS 2.0s single density\n");
-                printf("  16 + 40*26*128 = 133,136 bytes for DOS 2.5 enhanced density\n");
-                printf("  16 + 40*18*256 - 3*128 = 183,952 bytes for DOS 2.0d double density\n");
+
+        x = command(argc, argv, x);
+        if (image_close(disk)) {
+                fprintf(stderr, "Couldn't write back '%s'\n", disk_name);
+                x = -1;
+        }
+        disk = 0;
+        return x;
+}
+
+/* Close image at exit(), so changes made so far are written */
+
+void close_disk(void)
+{
+        if (disk) {
+                image_close(disk);
+                disk = 0;
+        }
+}
+
+/* Run command on each of a list of disk images.  The images are read ahead
+   (see scan.h), so with many small images the command doesn't have to wait
+   for each one to be read. */
+
+int each_command(char **images, int n, int argc, char *argv[], int x)
+{
+        struct scan *scan;
+        unsigned char *raw;
+        long size;
+        int rtn = 0;
+        int i;
+
+        if (is_write_cmd(argc, argv, x)) {
+                fprintf(stderr, "each only runs commands which don't change the images\n");
+                return -1;
+        }
+        atexit(close_disk);
+        if (cache_dir && cacheable(argc, argv, x))
+                atexit(abort_capture);
+
+        scan = scan_start(images, n, SCAN_DEPTH);
+        while ((i = scan_next(scan, &raw, &size)) != -1) {
+                struct image *img;
+                printf("%s:\n", images[i]);
+                fflush(stdout);
+                if (!raw) {
+                        scan_error(scan, i);
+                        rtn = -1;
+                } else if (!(img = image_open_mem(images[i], raw, size, 1))) {
+                        rtn = -1;
+                } else if (use_disk(img)) {
+                        close_disk();
+                        rtn = -1;
+                } else if (cache_dir && cacheable(argc, argv, x)) {
+                        rtn |= cached_command(disk_hash(), argc, argv, x);
+                        close_disk();
+                } else {
+                        rtn |= command(argc, argv, x);
+                        close_disk();
+                }
+        }
+        scan_end(scan);
+        return rtn;
+}
+
+/* Find duplicates in many disk images: files with the same contents, and
+   images with the same filesystem (see hash_files()).  The images are read
+   ahead as in each_command(). */
+
+int comp_dup(struct file_hash *l, struct file_hash *r)
+{
+        if (l->hash != r->hash)
+                return l->hash < r->hash ? -1 : 1;
+        if (l->size != r->size)
+                return l->size < r->size ? -1 : 1;
+        return l->image - r->image;
+}
+
+/* Print groups of more than one in sorted list */
+
+void print_dups(char *title, struct file_hash *list, int n, char **images)
+{
+        int x, y;
+        printf("%s:\n", title);
+        for (x = 0; x != n; x = y) {
+                for (y = x + 1; y != n && list[y].hash == list[x].hash && list[y].size == list[x].size; ++y);
+                if (y - x > 1) {
+                        int z;
+                        printf("\n");
+                        for (z = x; z != y; ++z)
+                                printf("%016llx %7ld  %s%s%s\n", list[z].hash, list[z].size, images[list[z].image],
+                                       list[z].name[0] ? ":" : "", list[z].name);
+                }
+        }
+        printf("\n");
+}
+
+int hash_command(char **images, int n)
+{
+        struct scan *scan;
+        struct file_hash *all = 0; /* Every non-empty file */
+        struct file_hash *fs; /* Filesystem of each image */
+        int all_n = 0;
+        int all_len = 0;
+        int fs_n = 0;
+        unsigned char *raw;
+        long size;
+        int rtn = 0;
+        int i;
+
+        atexit(close_disk);
+        fs = (struct file_hash *)malloc(sizeof(struct file_hash) * (n + 1));
+        scan = scan_start(images, n, SCAN_DEPTH);
+        while ((i = scan_next(scan, &raw, &size)) != -1) {
+                struct image *img;
+                struct file_hash *files;
+                int files_n;
+                int x;
+                if (!raw) {
+                        scan_error(scan, i);
+                        rtn = -1;
+                        continue;
+                }
+                if (!(img = image_open_mem(images[i], raw, size, 1))) {
+                        rtn = -1;
+                        continue;
+                }
+                if (use_disk(img)) {
+                        close_disk();
+                        rtn = -1;
+                        continue;
+                }
+                files_n = hash_files(&files);
+                rtn |= status;
+                fs[fs_n].name[0] = 0;
+                fs[fs_n].size = 0;
+                for (x = 0; x != files_n; ++x)
+                        fs[fs_n].size += files[x].size;
+                fs[fs_n].hash = fs_hash(files, files_n);
+                fs[fs_n].image = i;
+                ++fs_n;
+                for (x = 0; x != files_n; ++x) {
+                        if (!files[x].size)
+                                continue;
+                        if (all_n == all_len) {
+                                all_len = all_len * 2 + 64;
+                                all = (struct file_hash *)realloc(all, sizeof(struct file_hash) * all_len);
+                        }
+                        all[all_n] = files[x];
+                        all[all_n++].image = i;
+                }
+                free(files);
+                close_disk();
+        }
+        scan_end(scan);
+
+        qsort(all, all_n, sizeof(struct file_hash), (int (*)(const void *, const void *))comp_dup);
+        qsort(fs, fs_n, sizeof(struct file_hash), (int (*)(const void *, const void *))comp_dup);
+        print_dups("Same files", all, all_n, images);
+        print_dups("Same filesystems", fs, fs_n, images);
+        free(all);
+        free(fs);
+        return rtn;
+}
+
+/* Search files in many disk images: see grep_disk().  The images are read
+   ahead as in each_command().  Returns 0 if anything was found, 1 if not,
+   -1 for errors. */
+
+int grep_command(char *pat, int mode, char **images, int n)
+{
+        struct scan *scan;
+        unsigned char *raw;
+        long size;
+        long matches = 0;
+        int rtn = 0;
+        int i;
+
+        atexit(close_disk);
+        scan = scan_start(images, n, SCAN_DEPTH);
+        while ((i = scan_next(scan, &raw, &size)) != -1) {
+                struct image *img;
+                if (!raw) {
+                        scan_error(scan, i);
+                        rtn = -1;
+                } else if (!(img = image_open_mem(images[i], raw, size, 1))) {
+                        rtn = -1;
+                } else if (use_disk(img)) {
+                        close_disk();
+                        rtn = -1;
+                } else {
+                        matches += grep_disk(images[i], (unsigned char *)pat, strlen(pat), mode);
+                        if (status)
+                                rtn = -1;
+                        close_disk();
+                }
+        }
+        scan_end(scan);
+        if (rtn)
+                return rtn;
+        return matches ? 0 : 1;
+}
+
+/* Run command on every disk image in a .zip archive.  The archive is
+   opened once, and each image is read from it into memory in turn. */
+
+int zip_command(char *zip_name, int argc, char *argv[], int x)
+{
+        struct zip *zip;
+        struct zip_member *m;
+        int rtn = 0;
+
+        if (is_write_cmd(argc, argv, x)) {
+                fprintf(stderr, "'%s' is a .zip archive, which is read only\n", zip_name);
+                return -1;
+        }
+        if (!(zip = zip_open(zip_name)))
                 return -1;
+        atexit(close_disk);
+
+        for (m = zip->members; m; m = m->next) {
+                char *name;
+                unsigned char *raw;
+                long size;
+                struct image *img;
+                /* Only members named like disk images */
+                if (!image_format_by_name(m->name))
+                        continue;
+                name = (char *)malloc(strlen(zip_name) + strlen(m->name) + 2);
+                sprintf(name, "%s:%s", zip_name, m->name);
+                printf("%s:\n", name);
+                if (!(raw = zip_read(zip, m, &size)) || !(img = image_open_mem(name, raw, size, 1))) {
+                        rtn = -1;
+                } else if (use_disk(img)) {
+                        close_disk();
+                        rtn = -1;
+                } else {
+                        rtn |= command(argc, argv, x);
+                        close_disk();
+                }
+                free(name);
         }
+        zip_close(zip);
+        return rtn;
+}
+
+/* Run command on open disk */
+
+int command(int argc, char *argv[], int x)
+{
+        int all = 0;
+        int full = 0;
+        int single = 0;
 
         /* Directory options */
         dir:
         while (x != argc && argv[x][0] == '-') {
                 int y;
+                if (!strcmp(argv[x], "--drive")) {
+                        if (x + 1 == argc || !(ls_drive = drive_by_name(argv[x + 1]))) {
+                                fprintf(stderr, "Unknown drive: try 810, 1050, 1050-hs, xf551 or xf551-hs\n");
+                                return -1;
+                        }
+                        x += 2;
+                        continue;
+                }
                 for (y = 1;argv[x][y];++y) {
                         int opt = argv[x][y];
                         switch (opt) {
                                 case 'l': full = 1; break;
                                 case 'a': all = 1; break;
                                 case '1': single = 1; break;
+                                case 't': if (!ls_drive) ls_drive = drive_by_name("1050"); break;
                                 default: printf("Unknown option '%c'\n", opt); return -1;
                         }
                 }
@@ -1882,6 +4650,91 @@ int main(int argc, char *argv[])
                         ++x;
                 }
                 return atari_rename(old_name, new_name);
+        } else if (!strcmp(argv[x], "diff")) {
+                ++x;
+                if (x == argc) {
+                        fprintf(stderr, "Missing image to compare with\n");
+                        return -1;
+                }
+                return do_diff(argv[x], x + 1 != argc ? argv[x + 1] : NULL);
+        } else if (!strcmp(argv[x], "patch")) {
+                ++x;
+                if (x == argc) {
+                        fprintf(stderr, "Missing patch file\n");
+                        return -1;
+                }
+                return do_patch(argv[x]);
+        } else if (!strcmp(argv[x], "sync")) {
+                ++x;
+                if (x == argc) {
+                        fprintf(stderr, "Missing directory to sync from\n");
+                        return -1;
+                }
+                return do_sync(argv[x], NULL);
+        } else if (!strcmp(argv[x], "watch")) {
+                int delay = 300;
+                ++x;
+                if (x != argc && !strcmp(argv[x], "--delay") && x + 1 != argc) {
+                        delay = atoi(argv[x + 1]);
+                        x += 2;
+                }
+                if (x == argc) {
+                        fprintf(stderr, "Missing directory to watch\n");
+                        return -1;
+                }
+                return do_watch(argv[x], delay);
+        } else if (!strcmp(argv[x], "snapshot")) {
+                char out_name[1024];
+                char *p;
+                ++x;
+                if (x == argc) {
+                        fprintf(stderr, "Missing file name to snapshot\n");
+                        return -1;
+                }
+                if (x + 1 != argc) {
+                        return do_snapshot(argv[x], argv[x + 1]);
+                }
+                /* name.com -> name.mem */
+                snprintf(out_name, sizeof(out_name) - 4, "%s", argv[x]);
+                if ((p = strrchr(out_name, '.')))
+                        *p = 0;
+                strcat(out_name, ".mem");
+                return do_snapshot(argv[x], out_name);
+        } else if (!strcmp(argv[x], "recover")) {
+                return do_recover(argc, argv, x + 1);
+        } else if (!strcmp(argv[x], "restore")) {
+                if (x + 2 > argc) {
+                        fprintf(stderr, "Syntax: restore number [atari-name]\n");
+                        return -1;
+                }
+                return do_restore(argv[x + 1], x + 2 < argc ? argv[x + 2] : NULL);
+        } else if (!strcmp(argv[x], "scrub")) {
+                if (x + 1 != argc && strcmp(argv[x + 1], "-n")) {
+                        fprintf(stderr, "Syntax: scrub [-n]\n");
+                        return -1;
+                }
+                return do_scrub(x + 1 != argc);
+        } else if (!strcmp(argv[x], "hash")) {
+                return do_hash();
+        } else if (!strcmp(argv[x], "canonicalize")) {
+                return do_canonicalize();
+        } else if (!strcmp(argv[x], "defrag")) {
+                return do_defrag(argc, argv, x + 1, NULL);
+        } else if (!strcmp(argv[x], "optimize")) {
+                struct drive *drive = drive_by_name("1050");
+                ++x;
+                if (x != argc && !strcmp(argv[x], "--drive")) {
+                        if (x + 1 == argc || !(drive = drive_by_name(argv[x + 1]))) {
+                                fprintf(stderr, "Unknown drive: try 810, 1050, 1050-hs, xf551 or xf551-hs\n");
+                                return -1;
+                        }
+                        x += 2;
+                }
+                if (x == argc) {
+                        fprintf(stderr, "Missing names of files to optimize\n");
+                        return -1;
+                }
+                return do_defrag(argc, argv, x, drive);
         } else if (!strcmp(argv[x], "rm")) {
                 char *name;
                 ++x;
@@ -24,6 +24,11 @@
 #include <string.h>
 #include <sys/types.h>
 #include <time.h>
+#include "imd.h"
+#include "image.h"
+#include "pack.h"
+#include "zip.h"
+#include "sio.h"
 
 /* A loaded .ATR image */
 
@@ -41,6 +46,17 @@ struct atr {
 		2 = 180 K disk: 18 256-byte sectors / track
 		*/
 	int *map; /* Interleave map */
+	int skew; /* Rotate map this many more slots on each track */
+	int map_buf[256]; /* Space for a computed or custom map */
+};
+
+/* How the interleave is chosen */
+
+struct interleave {
+	char *profile; /* "standard" or a drive name: best map for the drive */
+	char *custom; /* Custom map "1,3,5,..." or NULL */
+	int gap; /* Gap between consecutive sectors if not 0 */
+	int skew; /* Track skew */
 };
 
 /* Free .atr image */
@@ -52,120 +68,40 @@ void free_atr(struct atr *atr)
 	free(atr);
 }
 
-/* Interleave map for 90K disks */
-int sd_map[] = 
-  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 2, 4, 6, 8, 10, 12, 14, 16, 18 };
-
-/* Interleave map for 130K disks */
-int dd_map[] =
-  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26 };
-
-/* Interleave map for 180K disks */
-int hd_map[] = 
-  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 2, 4, 6, 8, 10, 12, 14, 16, 18 };
-
-/* Read .atr image */
+/* Read disk image: any format image.c knows about */
 
 struct atr *read_atr(char *name, int force_ed, int force_dd)
 {
 	struct atr *atr;
-	FILE *f = fopen(name, "rb");
-	unsigned char header[16];
-	int sec_size; /* Sector size from header */
-	if (!f) {
-		fprintf(stderr, "Couldn't open %s\n", name);
-		return 0;
-	}
-	if (1 != fread(header, 16, 1, f)) {
-		fprintf(stderr, "Header missing from %s\n", name);
-		fclose(f);
-		return 0;
-	}
-	if (header[0] != 0x96 || header[1] != 0x02) {
-		fprintf(stderr, "Warning.. magic number is not 0x0296\n");
-	}
-	atr = (struct atr *)malloc(sizeof(struct atr));
-	atr->map = 0;
-	atr->data =0;
-
-	/* Get image size from header */
-	atr->size = ((long)header[2] + ((long)header[3] << 8) + ((long)header[6] << 16)) * 0x10;
-
-
-	/* Get sector size from header */
-	sec_size = header[4] + (header[5] << 8);
+	struct image *img;
+	int sec_size; /* Sector size from image */
+	int x;
 
-	/* Check sector size */
-	if (sec_size == 0x80)
-		atr->type = 0;
-	else if (sec_size == 0x100)
-		atr->type = 1;
-	else {
-		fprintf(stderr, "Unknown sector size %d\n", sec_size);
-		free_atr(atr);
-		fclose(f);
+	if (!(img = image_open(name, 1)))
 		return 0;
-	}
+	sec_size = img->sec_size;
 
-	/* Get actual image size, don't trust size from header */
-	fseek(f, 0, SEEK_END);
-	atr->size = ftell(f) - 16;
-	fseek(f, 16, SEEK_SET);
+	atr = (struct atr *)malloc(sizeof(struct atr));
+	atr->map = 0;
+	atr->skew = 0;
+	atr->type = (sec_size == 256);
+	atr->size = (long)img->nsects * sec_size;
 
-	/* Allocate space for image: give extra space to expand boot sectors */
-	atr->data = (unsigned char *)malloc(atr->size + 3 * 128);
+	/* Allocate space for image: boot sectors are expanded to physical sectors */
+	atr->data = (unsigned char *)calloc(atr->size + 1, 1);
 	if (!atr->data) {
 		fprintf(stderr, "Couldn't allocate space for image\n");
 		free_atr(atr);
-		fclose(f);
+		image_close(img);
 		return 0;
 	}
 
-	/* Read image */
-	if (1 != fread(atr->data, atr->size, 1, f)) {
-		fprintf(stderr, "Error reading from file\n");
-		free_atr(atr);
-		fclose(f);
-		return 0;
-	}
-	/* Success! */
-	fclose(f);
-
-	/* Deal with boot sectors */
-	if (sec_size == 256) {
-		if ((atr->size >> 7) & 1) {
-			/* It has an odd number of 128 bytes chunks.. first
-			   three sectors are 128 bytes.  Expand image to make
-			   physical sectors. */
-			memmove(atr->data + 768, atr->data + 384, atr->size - 384);
-			memcpy(atr->data + 512, atr->data + 256, 128);
-			memset(atr->data + 640, 0, 128);
-
-			memcpy(atr->data + 256, atr->data + 128, 128);
-			memset(atr->data + 384, 0, 128);
-
-			memset(atr->data + 128, 0, 128);
-			atr->size += 384;
-		} else {
-			int x;
-			int flg = 0;
-			for (x = 384; x != 768; ++x)
-				if (atr->data[x])
-					flg = 1;
-			if (!flg) {
-				/* Bytes 384 - 768 are all zeros.  SIO2PC does this */
-				memcpy(atr->data + 512, atr->data + 256, 128);
-				memset(atr->data + 640, 0, 128);
-
-				memcpy(atr->data + 256, atr->data + 128, 128);
-				memset(atr->data + 384, 0, 128);
-
-				memset(atr->data + 128, 0, 128);
-			} else {
-				/* We already have physical sectors */
-			}
-		}
-	}
+	/* Read image: keep all of the first three sectors if they are there */
+	image_full_boot(img);
+	for (x = 1; x <= img->nsects; ++x)
+		if (image_read(img, atr->data + (long)sec_size * (x - 1), x))
+			fprintf(stderr, "Warning.. couldn't read sector %d, using zeros\n", x);
+	image_close(img);
 
 	printf("Converting %s (%ld %dB sectors) ", name, atr->size/sec_size, sec_size);
 
@@ -201,27 +137,104 @@ struct atr *read_atr(char *name, int force_ed, int force_dd)
 	return atr;
 }
 
-/* True if all bytes are the same */
+/* Parse custom map: comma separated sector numbers in track order */
 
-int is_same(unsigned char *data, int len)
+int parse_map(int *map, int spt, char *s)
 {
-	int c = data[0];
+	int seen[256];
+	int n = 0;
+	memset(seen, 0, sizeof(seen));
+	while (*s) {
+		char *e;
+		long v = strtol(s, &e, 10);
+		if (e == s || v < 1 || v > spt || seen[v] || n == spt) {
+			fprintf(stderr, "Bad custom map: need each of sectors 1 - %d once\n", spt);
+			return -1;
+		}
+		seen[v] = 1;
+		map[n++] = v;
+		s = e;
+		if (*s == ',')
+			++s;
+	}
+	if (n != spt) {
+		fprintf(stderr, "Bad custom map: need each of sectors 1 - %d once\n", spt);
+		return -1;
+	}
+	return 0;
+}
+
+/* Pick interleave map for image */
+
+int set_interleave(struct atr *atr, struct interleave *il)
+{
+	int nsects = atr->cyls * atr->sects;
+	if (il->custom) {
+		if (parse_map(atr->map_buf, atr->sects, il->custom))
+			return -1;
+		atr->map = atr->map_buf;
+		atr->skew = il->skew;
+	} else if (il->gap) {
+		if (il->gap < 1 || il->gap >= atr->sects) {
+			fprintf(stderr, "Gap must be 1 - %d\n", atr->sects - 1);
+			return -1;
+		}
+		sio_make_map(atr->map_buf, atr->sects, il->gap);
+		atr->map = atr->map_buf;
+		atr->skew = il->skew;
+	} else if (strcmp(il->profile, "standard")) {
+		struct drive *drive = drive_by_name(il->profile);
+		int gap;
+		if (!drive) {
+			fprintf(stderr, "Unknown interleave profile '%s'\n", il->profile);
+			return -1;
+		}
+		sio_best_map(drive, atr->sec_size, nsects, &gap, &atr->skew);
+		sio_make_map(atr->map_buf, atr->sects, gap);
+		atr->map = atr->map_buf;
+	} else
+		atr->skew = il->skew;
+	if (atr->map != sio_default_map(atr->sec_size, nsects) || atr->skew) {
+		int x;
+		printf("Interleave map:");
+		for (x = 0; x != atr->sects; ++x)
+			printf("%c%d", x ? ',' : ' ', atr->map[x]);
+		printf(", track skew %d\n", atr->skew);
+	}
+	return 0;
+}
+
+/* Find best gap and skew for a drive and print them */
+
+void best_skew(struct drive *drive, int sec_size, int nsects)
+{
+	int spt = sio_spt(nsects);
+	int map[256];
+	int gap, skew;
+	double t;
 	int x;
-	for (x = 1; x != len; ++x)
-		if (data[x] != c)
-			return 0;
-	return 1;
+	t = sio_best_map(drive, sec_size, nsects, &gap, &skew);
+	sio_make_map(map, spt, gap);
+	printf("%d %dB sectors at %g baud, %g ms step, %g RPM:\n", nsects, sec_size, drive->baud, drive->step, drive->rpm);
+	printf("  standard (gap %d, skew 0): %.2fs\n", spt / 2,
+	       sio_disk_time(drive, sec_size, nsects, sio_default_map(sec_size, nsects), 0) / 1000.0);
+	printf("  best (gap %d, skew %d): %.2fs\n", gap, skew, t / 1000.0);
+	printf("  --map ");
+	for (x = 0; x != spt; ++x)
+		printf("%s%d", x ? "," : "", map[x]);
+	printf(" --skew %d\n", skew);
 }
 
 /* Convert IMD file */
 
-int write_imd(struct atr *atr, char *dest_name, char *comment)
+int convert_imd(struct atr *atr, char *dest_name, char *comment)
 {
 	FILE *f;
 	time_t t = time(NULL);
 	struct tm *tm = localtime(&t);
-	int cyl;
-	int sect;
+	struct imd *imd;
+	char *header;
+	int rtn;
 	int x;
 
 	f = fopen(dest_name, "rb");
@@ -236,72 +249,41 @@ int write_imd(struct atr *atr, char *dest_name, char *comment)
 		}
 	}
 
-	f = fopen(dest_name, "wb");
-
-	if (!f) {
-		fprintf(stderr,"Couldn't open %s for writing\n", dest_name);
-		return 1;
-	}
-
-	/* Write timestamp */
-	fprintf(f, "ATR2IMD 1.0: %2.2d/%2.2d/%4.4d %2.2d:%2.2d:%2.2d\n",
+	/* Timestamp, then comment */
+	header = (char *)malloc(strlen(comment) + 80);
+	sprintf(header, "ATR2IMD 1.0: %2.2d/%2.2d/%4.4d %2.2d:%2.2d:%2.2d\n%s\n",
 	       tm->tm_mday,tm->tm_mon + 1,tm->tm_year + 1900,tm->tm_hour,
-	       tm->tm_min,tm->tm_sec);
-
-	/* Write comment */
-	fprintf(f, "%s\n\x1a", comment);
-
-	/* Write tracks */
-	for (cyl = 0; cyl != atr->cyls; ++cyl) {
-		if (atr->dd)
-			fputc(5, f); /* 250 Kbps MFM */
-		else
-			fputc(2, f); /* 250 Kbps FM */
-		fputc(cyl, f); /* Cylinder */
-		fputc(0, f); /* Head */
-		fputc(atr->sects, f); /* Number of sectors */
-		if (atr->sec_size == 256)
-			fputc(1, f); /* Bytes per sector 0 = 128 */
-		else
-			fputc(0, f); /* Bytes per sector 1 = 256 */
-		/* Sector map */
-		for (x = 0; x != atr->sects; ++x) {
-			fputc(atr->map[x], f);
-		}
-		/* Cylinder map (empty) */
-		/* Head map (empty) */
-		/* Sectors */
-		for (x = 0; x != atr->sects; ++x) {
-			int ofst;
-			int dbl = 0;
-			sect = atr->map[x] - 1;
-			ofst = atr->sec_size * (cyl * atr->sects + sect);
-			if (ofst >= atr->size) {
-				fputc(2, f);
-				fputc(~0, f);
-			} else if (is_same(atr->data + ofst, atr->sec_size)) {
-				fputc(2, f);
-				fputc(~atr->data[ofst], f);
-			} else {
-				int y;
-				fputc(1, f);
-				if (dbl) {
-					for (y = 0; y != 128; ++y) {
-						fputc(~atr->data[ofst + y], f);
-					}
-					for (y = 0; y != 128; ++y) {
-						fputc(~0, f);
-					}
-				} else
-					for (y = 0; y != atr->sec_size; ++y) {
-						fputc(~atr->data[ofst + y], f);
-					}
+	       tm->tm_min,tm->tm_sec, comment);
+
+	/* 250 Kbps MFM or 250 Kbps FM */
+	imd = imd_new(header, atr->cyls, atr->sects, atr->sec_size, (atr->dd ? 5 : 2), atr->map);
+	free(header);
+
+	/* Rotate each track's map for track skew */
+	if (atr->skew) {
+		struct track *t;
+		for (t = imd->tracks; t; t = t->next) {
+			int rot = t->cyl * atr->skew;
+			for (x = 0; x != t->sects; ++x) {
+				t->map[(x + rot) % t->sects] = atr->map[x];
+				t->slot[atr->map[x]] = (x + rot) % t->sects;
 			}
 		}
 	}
 
-	fclose(f);
-	return 0;
+	/* Sectors past end of image are left as zeros */
+	for (x = 0; x != atr->cyls * atr->sects; ++x) {
+		long ofst = (long)atr->sec_size * x;
+		unsigned char *p = imd_sector(imd, x + 1);
+		if (ofst < atr->size) {
+			memcpy(p, atr->data + ofst, atr->sec_size);
+			invert(p, atr->sec_size);
+		}
+	}
+
+	rtn = write_imd(imd, dest_name);
+	free_imd(imd);
+	return rtn;
 }
 
 int main(int argc, char *argv[])
@@ -312,6 +294,15 @@ int main(int argc, char *argv[])
 	char *comment = 0;
 	int force_ed = 0;
 	int force_dd = 0;
+	int best = 0;
+	struct drive drive[1];
+	struct interleave il[1];
+
+	*drive = *drive_by_name("1050");
+	il->profile = "standard";
+	il->custom = 0;
+	il->gap = 0;
+	il->skew = 0;
 
 	/* Parse args */
 
@@ -329,6 +320,48 @@ int main(int argc, char *argv[])
 			} else if (!strcmp(argv[x], "--dd")) {
 				force_ed = 0;
 				force_dd = 1;
+			} else if (!strcmp(argv[x], "--interleave") && argv[x + 1]) {
+				il->profile = argv[++x];
+				il->custom = 0;
+				il->gap = 0;
+			} else if (!strcmp(argv[x], "--map") && argv[x + 1]) {
+				il->custom = argv[++x];
+			} else if (!strcmp(argv[x], "--gap") && argv[x + 1]) {
+				il->gap = atoi(argv[++x]);
+				if (il->gap < 1) {
+					fprintf(stderr, "Gap must be at least 1\n");
+					return 1;
+				}
+			} else if (!strcmp(argv[x], "--skew") && argv[x + 1]) {
+				il->skew = atoi(argv[++x]);
+				if (il->skew < 0) {
+					fprintf(stderr, "Skew can't be negative\n");
+					return 1;
+				}
+			} else if (!strcmp(argv[x], "--best-skew")) {
+				best = 1;
+			} else if (!strcmp(argv[x], "--drive") && argv[x + 1]) {
+				struct drive *d = drive_by_name(argv[++x]);
+				if (!d) {
+					fprintf(stderr, "Unknown drive '%s'\n", argv[x]);
+					return 1;
+				}
+				*drive = *d;
+			} else if (!strcmp(argv[x], "--baud") && argv[x + 1]) {
+				if ((drive->baud = atof(argv[++x])) <= 0) {
+					fprintf(stderr, "Baud rate must be more than 0\n");
+					return 1;
+				}
+			} else if (!strcmp(argv[x], "--step") && argv[x + 1]) {
+				if ((drive->step = atof(argv[++x])) <= 0) {
+					fprintf(stderr, "Step time must be more than 0\n");
+					return 1;
+				}
+			} else if (!strcmp(argv[x], "--rpm") && argv[x + 1]) {
+				if ((drive->rpm = atof(argv[++x])) <= 0) {
+					fprintf(stderr, "RPM must be more than 0\n");
+					return 1;
+				}
 			} else {
 				err = 1;
 				break;
@@ -339,9 +372,19 @@ int main(int argc, char *argv[])
 			char dest_name[1024];
 			char cmnt[1024];
 			char *source_name = argv[x];
+			char *path;
+			char *arc;
 
 			/* Create destination name based on source name */
-			strcpy(dest_name, source_name);
+			if ((arc = zip_split(source_name, &path))) {
+				/* Put it in current directory if source is in a .zip archive */
+				if (strrchr(path, '/'))
+					path = strrchr(path, '/') + 1;
+				strcpy(dest_name, path);
+				free(arc);
+			} else
+				strcpy(dest_name, source_name);
+			dest_name[strlen(dest_name) - pack_ext_len(dest_name)] = 0; /* Drop .gz */
 			if ((p = strrchr(dest_name, '.')))
 				*p = 0;
 			strcat(dest_name, ".imd");
@@ -356,8 +399,11 @@ int main(int argc, char *argv[])
 			if (!(atr = read_atr(source_name, force_ed, force_dd)))
 				return 1;
 
+			if (set_interleave(atr, il))
+				return 1;
+
 			/* Write .imd file */
-			if (write_imd(atr, dest_name, comment))
+			if (convert_imd(atr, dest_name, comment))
 				return 1;
 
 			/* Free .atr image */
@@ -369,9 +415,20 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (best && !err && drive->baud > 0.0 && drive->rpm > 0.0) {
+		if (force_dd)
+			best_skew(drive, 256, 720);
+		else if (force_ed)
+			best_skew(drive, 128, 1040);
+		else
+			best_skew(drive, 128, 720);
+		did = 1;
+	}
+
 	if (!did || err) {
 		fprintf(stderr,"Convert Nick Kennedy's .ATR (ATARI) disk image file format to\n");
 		fprintf(stderr,"Dave Dunfield's .IMD (ImageDisk) file format.\n");
+		fprintf(stderr,".XFD and .DCM images are also accepted.\n");
 		fprintf(stderr,"\n");
 		fprintf(stderr,"       version 1.0\n");
 		fprintf(stderr,"       by: Joe Allen (2011)\n");
@@ -387,6 +444,24 @@ int main(int argc, char *argv[])
 		fprintf(stderr,"  --sd                  Force single density (90K disk, 128 byte FM sectors)\n");
 		fprintf(stderr,"  --ed                  Force medium density (130K disk, 128 byte MFM sectors)\n");
 		fprintf(stderr,"  --dd                  Force double density (180K disk, 256 byte MFM sectors)\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"Interleave (sector order on each track):\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"  --interleave <name>   'standard' (the default: what the stock drives\n");
+		fprintf(stderr,"                        format), or a drive name for the fastest map on\n");
+		fprintf(stderr,"                        that drive:");
+		for (x = 0; drives[x].name; ++x)
+			fprintf(stderr," %s", drives[x].name);
+		fprintf(stderr,"\n");
+		fprintf(stderr,"  --map <1,3,5,...>     Custom map: sector numbers in track order\n");
+		fprintf(stderr,"  --gap <n>             Map with consecutive sectors n slots apart\n");
+		fprintf(stderr,"  --skew <n>            Rotate each track's map n slots from the last\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"atr2imd --best-skew [--drive <name>] [--baud <n>] [--step <ms>] [--rpm <n>]\n");
+		fprintf(stderr,"        [--sd|--ed|--dd]\n");
+		fprintf(stderr,"\n");
+		fprintf(stderr,"  Find the gap and skew which read a whole disk fastest.  The drive\n");
+		fprintf(stderr,"  defaults to 1050, --baud, --step and --rpm change it.\n");
 		return 1;
 	}
 
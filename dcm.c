@@ -0,0 +1,470 @@
+/*	DiskComm (.DCM) compressed disk images
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* A .DCM file is one or more passes.  Each pass is:
+ *
+ *   0xF9 or 0xFA   Archive type (0xFA is the first disk of a multi-disk archive)
+ *   flags          bit 7: set for last pass
+ *                  bits 5 - 6: density: 0 = single, 1 = double, 2 = enhanced
+ *                  bits 0 - 4: pass number, starting with 1
+ *   lo, hi         First sector number of pass
+ *
+ * Then sector records until an 0x45 record ends the pass.  Each record
+ * begins with a type byte.  If bit 7 of the type is set, the next record is
+ * for the following sector number, otherwise a 16-bit sector number for
+ * the next record follows the record data.  Records describe changes to a
+ * sector buffer which carries over from one sector to the next:
+ *
+ *   0x41  Modify begin: offset n, then bytes n down to 0 in reverse order
+ *   0x42  DOS sector: offset n, then bytes 0 .. n-1; bytes up to the last
+ *         three are zero, then the three link bytes
+ *   0x43  Compressed: alternating literal runs and fills:
+ *         end offset, literal bytes, end offset, fill byte, ...
+ *   0x44  Modify end: offset n, then bytes n to end of sector
+ *   0x45  End of pass
+ *   0x46  Same as previous sector
+ *   0x47  Uncompressed: whole sector follows
+ *
+ * An offset of 0 means 256 (except for the first offset of 0x43 records).
+ * Sectors not in the file are all zeros.
+ *
+ * The encoder tries each record type for each sector and keeps the
+ * shortest.  It never uses 0x42, and the first record of each pass doesn't
+ * depend on the previous sector, in case a decoder clears its buffer
+ * between passes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+
+#define DCM_SINGLE 0
+#define DCM_DOUBLE 1
+#define DCM_ENHANCED 2
+
+/* Start a new pass when a pass gets this big, so that DiskComm on the
+   Atari has room to unpack it */
+#define DCM_PASS_LIMIT 0x6000
+
+/* Input stream */
+
+struct dcm_in {
+	unsigned char *p;
+	long left;
+	int err;
+};
+
+static int get_byte(struct dcm_in *in)
+{
+	if (!in->left) {
+		in->err = 1;
+		return 0;
+	}
+	--in->left;
+	return *in->p++;
+}
+
+static int get_offset(struct dcm_in *in)
+{
+	int c = get_byte(in);
+	return c ? c : 256;
+}
+
+static int get_word(struct dcm_in *in)
+{
+	int c = get_byte(in);
+	return c + (get_byte(in) << 8);
+}
+
+static int dcm_probe(unsigned char *raw, long size)
+{
+	if (size >= 5 && (raw[0] == 0xF9 || raw[0] == 0xFA) && (raw[1] & 0x1F) == 1 && ((raw[1] >> 5) & 3) != 3)
+		return 2;
+	return 0;
+}
+
+/* Decode one record into buf, which holds the previous sector */
+
+static int dcm_record(struct dcm_in *in, int type, unsigned char *buf, int size)
+{
+	int x, n;
+	switch (type) {
+		case 0x41: { /* Modify begin */
+			n = get_byte(in);
+			if (n >= size)
+				return -1;
+			for (x = n; x >= 0; --x)
+				buf[x] = get_byte(in);
+			break;
+		} case 0x42: { /* DOS sector */
+			n = get_byte(in);
+			if (n > size - 3)
+				return -1;
+			for (x = 0; x != n; ++x)
+				buf[x] = get_byte(in);
+			for (; x != size - 3; ++x)
+				buf[x] = 0;
+			for (; x != size; ++x)
+				buf[x] = get_byte(in);
+			break;
+		} case 0x43: { /* Compressed */
+			x = 0;
+			n = get_byte(in);
+			for (;;) {
+				if (n > size || n < x)
+					return -1;
+				while (x != n)
+					buf[x++] = get_byte(in);
+				if (x == size)
+					break;
+				n = get_offset(in);
+				if (n > size || n < x)
+					return -1;
+				memset(buf + x, get_byte(in), n - x);
+				x = n;
+				if (x == size)
+					break;
+				n = get_offset(in);
+			}
+			break;
+		} case 0x44: { /* Modify end */
+			n = get_offset(in);
+			if (n > size)
+				return -1;
+			for (x = n; x != size; ++x)
+				buf[x] = get_byte(in);
+			break;
+		} case 0x46: { /* Same as previous */
+			break;
+		} case 0x47: { /* Uncompressed */
+			for (x = 0; x != size; ++x)
+				buf[x] = get_byte(in);
+			break;
+		} default: {
+			return -1;
+		}
+	}
+	return in->err ? -1 : 0;
+}
+
+/* Decode passes straight into the sector array */
+
+static int dcm_open(struct image *img)
+{
+	struct dcm_in in[1];
+	unsigned char buf[256];
+	int pass = 1;
+	int density = -1;
+
+	in->p = img->raw;
+	in->left = img->size;
+	in->err = 0;
+	memset(buf, 0, sizeof(buf));
+
+	for (;;) {
+		int flags;
+		int sect;
+		int c = get_byte(in);
+		if (c != 0xF9 && c != 0xFA) {
+			fprintf(stderr, "Bad archive type in pass %d\n", pass);
+			return -1;
+		}
+		flags = get_byte(in);
+		if ((flags & 0x1F) != pass) {
+			fprintf(stderr, "Pass %d out of order\n", pass);
+			return -1;
+		}
+		if (density == -1) {
+			density = ((flags >> 5) & 3);
+			switch (density) {
+				case DCM_SINGLE: img->sec_size = 128; img->nsects = 720; break;
+				case DCM_DOUBLE: img->sec_size = 256; img->nsects = 720; break;
+				case DCM_ENHANCED: img->sec_size = 128; img->nsects = 1040; break;
+				default: fprintf(stderr, "Unknown density\n"); return -1;
+			}
+			img->data = (unsigned char *)calloc(img->nsects, img->sec_size);
+		}
+		sect = get_word(in);
+		for (;;) {
+			int type = get_byte(in);
+			int size;
+			if (in->err)
+				break;
+			if (type == 0x45)
+				break;
+			if (sect < 1 || sect > img->nsects) {
+				fprintf(stderr, "Bad sector number %d\n", sect);
+				return -1;
+			}
+			size = image_sect_size(img, sect);
+			if (dcm_record(in, (type & 0x7F), buf, size)) {
+				fprintf(stderr, "Bad record type 0x%x for sector %d\n", type, sect);
+				return -1;
+			}
+			image_data_write(img, buf, sect);
+			if (type & 0x80)
+				++sect;
+			else
+				sect = get_word(in);
+		}
+		if (in->err) {
+			fprintf(stderr, "Archive is truncated in pass %d\n", pass);
+			return -1;
+		}
+		if (flags & 0x80)
+			break;
+		++pass;
+	}
+	return 0;
+}
+
+/* Create empty image */
+
+static int dcm_create(struct image *img)
+{
+	if (img->sec_size == 256 && img->nsects <= 720) {
+		img->nsects = 720;
+	} else if (img->sec_size == 128 && img->nsects <= 720) {
+		img->nsects = 720;
+	} else if (img->sec_size == 128 && img->nsects <= 1040) {
+		img->nsects = 1040;
+	} else {
+		fprintf(stderr, "DiskComm can only store 720 or 1040 sector disks\n");
+		return -1;
+	}
+	img->data = (unsigned char *)calloc(img->nsects, img->sec_size);
+	return 0;
+}
+
+/* Sector compressors: each writes the record (type byte first) to out and
+   returns its length, or -1 if the record type can't be used */
+
+/* Modify begin: sector differs from previous only up to some offset */
+
+static int dcm_begin(unsigned char *out, unsigned char *buf, unsigned char *prev, int size)
+{
+	int n, x;
+	for (n = size - 1; n >= 0 && buf[n] == prev[n]; --n);
+	if (n < 0 || n > 255)
+		return -1;
+	out[0] = 0x41;
+	out[1] = n;
+	for (x = 0; x <= n; ++x)
+		out[2 + x] = buf[n - x];
+	return n + 3;
+}
+
+/* Modify end: sector differs from previous only after some offset */
+
+static int dcm_end(unsigned char *out, unsigned char *buf, unsigned char *prev, int size)
+{
+	int n;
+	for (n = 0; n != size && buf[n] == prev[n]; ++n);
+	if (n == 0 || n == size)
+		return -1;
+	out[0] = 0x44;
+	out[1] = n;
+	memcpy(out + 2, buf + n, size - n);
+	return size - n + 2;
+}
+
+/* Compressed: literal runs and fills.  Fills shorter than this are
+   cheaper as literals. */
+
+#define DCM_MIN_FILL 4
+
+static int dcm_rle(unsigned char *out, unsigned char *buf, int size)
+{
+	int len = 0;
+	int x = 0;
+	out[len++] = 0x43;
+	for (;;) {
+		int r, e;
+		/* Find next fill */
+		for (r = x; r != size; ++r) {
+			for (e = r + 1; e != size && buf[e] == buf[r]; ++e);
+			if (e - r >= DCM_MIN_FILL)
+				break;
+		}
+		/* First offset is a plain byte: 256 doesn't fit */
+		if (len == 1 && r == 256)
+			return -1;
+		/* Literal run */
+		out[len++] = r;
+		memcpy(out + len, buf + x, r - x);
+		len += r - x;
+		x = r;
+		if (x == size)
+			break;
+		/* Fill */
+		for (e = x + 1; e != size && buf[e] == buf[x]; ++e);
+		out[len++] = e;
+		out[len++] = buf[x];
+		x = e;
+		if (x == size)
+			break;
+	}
+	return len;
+}
+
+/* Pick best record for a sector.  first is set for the first sector of a
+   pass, where we don't depend on the previous sector. */
+
+static int dcm_best(unsigned char *out, unsigned char *buf, unsigned char *prev, int size, int first)
+{
+	unsigned char tmp[260];
+	int len;
+	int n;
+
+	/* Uncompressed */
+	out[0] = 0x47;
+	memcpy(out + 1, buf, size);
+	len = size + 1;
+
+	if (!first) {
+		if (!memcmp(buf, prev, size)) {
+			out[0] = 0x46;
+			return 1;
+		}
+		n = dcm_begin(tmp, buf, prev, size);
+		if (n != -1 && n < len) {
+			memcpy(out, tmp, n);
+			len = n;
+		}
+		n = dcm_end(tmp, buf, prev, size);
+		if (n != -1 && n < len) {
+			memcpy(out, tmp, n);
+			len = n;
+		}
+	}
+	n = dcm_rle(tmp, buf, size);
+	if (n != -1 && n < len) {
+		memcpy(out, tmp, n);
+		len = n;
+	}
+	return len;
+}
+
+/* True if sector is all zeros: these are left out */
+
+static int dcm_empty(unsigned char *buf, int size)
+{
+	int x;
+	for (x = 0; x != size; ++x)
+		if (buf[x])
+			return 0;
+	return 1;
+}
+
+/* End a pass: the last record needs no sector number */
+
+static long dcm_end_pass(unsigned char *out, long len, long last_type)
+{
+	if (last_type != -1)
+		out[last_type] |= 0x80;
+	out[len++] = 0x45;
+	return len;
+}
+
+static int dcm_encode(struct image *img)
+{
+	unsigned char prev[256];
+	unsigned char buf[256];
+	unsigned char *out;
+	long len = 0;
+	long pass_start = -1; /* Offset to header of current pass */
+	long last_type = -1; /* Offset to type byte of previous record in pass */
+	int last_sect = 0;
+	int pass = 0;
+	int density;
+	int sect;
+
+	if (img->sec_size == 256)
+		density = DCM_DOUBLE;
+	else if (img->nsects > 720)
+		density = DCM_ENHANCED;
+	else
+		density = DCM_SINGLE;
+
+	/* Worst case: every sector uncompressed with a sector number and its
+	   own pass */
+	out = (unsigned char *)malloc((long)img->nsects * (img->sec_size + 8) + 16);
+	if (!out) {
+		fprintf(stderr, "Couldn't allocate space for image\n");
+		return -1;
+	}
+	memset(prev, 0, sizeof(prev));
+
+	for (sect = 1; sect <= img->nsects; ++sect) {
+		int size = image_sect_size(img, sect);
+		image_data_read(img, buf, sect);
+		if (dcm_empty(buf, size))
+			continue;
+		if (pass_start != -1 && len - pass_start >= DCM_PASS_LIMIT) {
+			len = dcm_end_pass(out, len, last_type);
+			pass_start = -1;
+		}
+		if (pass_start == -1) {
+			pass_start = len;
+			out[len++] = 0xF9;
+			out[len++] = ++pass | (density << 5);
+			out[len++] = sect;
+			out[len++] = (sect >> 8);
+			last_type = -1;
+		} else if (sect == last_sect + 1) {
+			out[last_type] |= 0x80;
+		} else {
+			out[len++] = sect;
+			out[len++] = (sect >> 8);
+		}
+		last_type = len;
+		last_sect = sect;
+		len += dcm_best(out + len, buf, prev, size, (pass_start + 4 == len));
+		memcpy(prev, buf, size);
+	}
+
+	/* An empty disk still needs one pass */
+	if (pass_start == -1) {
+		pass_start = len;
+		out[len++] = 0xF9;
+		out[len++] = ++pass | (density << 5);
+		out[len++] = 1;
+		out[len++] = 0;
+		last_type = -1;
+	}
+	len = dcm_end_pass(out, len, last_type);
+	out[pass_start + 1] |= 0x80;
+
+	if (img->raw)
+		free(img->raw);
+	img->raw = out;
+	img->size = len;
+	return 0;
+}
+
+static void dcm_close(struct image *img)
+{
+	if (img->data)
+		free(img->data);
+}
+
+struct image_format dcm_format = {
+	"dcm", "DiskComm compressed image",
+	dcm_probe, dcm_open, dcm_create, image_data_read, image_data_write, dcm_encode, dcm_close
+};
@@ -0,0 +1,782 @@
+/*	Disk image formats
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(HAVE_MMAP) || defined(HAVE_FLOCK)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_FLOCK
+#include <errno.h>
+#include <sys/file.h>
+#endif
+#include "imd.h"
+#include "pack.h"
+#include "zip.h"
+#include "image.h"
+
+struct image_format *image_formats[] = {
+	&atr_format,
+	&xfd_format,
+	&dcm_format,
+	&imd_format,
+	0
+};
+
+/* Read whole file into memory */
+
+static unsigned char *load_file(char *name, long *size)
+{
+	unsigned char *raw;
+	long len;
+	FILE *f = fopen(name, "rb");
+	if (!f) {
+		fprintf(stderr, "Couldn't open '%s'\n", name);
+		return 0;
+	}
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0) {
+		fprintf(stderr, "Couldn't get size of '%s'\n", name);
+		fclose(f);
+		return 0;
+	}
+	rewind(f);
+	raw = (unsigned char *)malloc(len + 1);
+	if (!raw) {
+		fprintf(stderr, "Couldn't allocate space for '%s'\n", name);
+		fclose(f);
+		return 0;
+	}
+	if (len && 1 != fread(raw, len, 1, f)) {
+		fprintf(stderr, "Couldn't read '%s'\n", name);
+		free(raw);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	*size = len;
+	return raw;
+}
+
+#ifdef HAVE_MMAP
+
+/* Map whole file read only.  Returns NULL if it can't be mapped (it's empty
+   or not a plain file): then it's read with load_file() instead. */
+
+static unsigned char *map_file(char *name, long *size)
+{
+	struct stat st;
+	void *p;
+	int fd = open(name, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size) {
+		close(fd);
+		return 0;
+	}
+	p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 0;
+	*size = st.st_size;
+	return (unsigned char *)p;
+}
+
+#endif
+
+int image_lock_wait = 30;
+
+#ifdef HAVE_FLOCK
+
+/* Lock file: shared for reading, exclusive for writing.  Waits up to
+   image_lock_wait seconds for other processes.  Returns file descriptor
+   holding the lock, -1 if there is no file to lock or -2 for error. */
+
+#define LOCK_POLL 50 /* ms between tries */
+
+int image_lock(char *name, int excl)
+{
+	/* Time waited in ms: sleeps are counted, since time() is only good to
+	   a second and would cut the wait short */
+	long waited = 0;
+	for (;;) {
+		struct stat st, now;
+		int fd = open(name, O_RDONLY);
+		if (fd == -1)
+			return -1;
+		while (flock(fd, (excl ? LOCK_EX : LOCK_SH) | LOCK_NB)) {
+			if (errno != EWOULDBLOCK && errno != EINTR) {
+				fprintf(stderr, "Couldn't lock '%s'\n", name);
+				close(fd);
+				return -2;
+			}
+			if (image_lock_wait >= 0 && waited >= image_lock_wait * 1000L) {
+				fprintf(stderr, "'%s' is in use by another process\n", name);
+				close(fd);
+				return -2;
+			}
+			usleep(LOCK_POLL * 1000);
+			waited += LOCK_POLL;
+		}
+		/* The file may have been replaced while we waited (see atomic in
+		   image.h): then lock the new one */
+		if (!fstat(fd, &st) && !stat(name, &now) && st.st_dev == now.st_dev && st.st_ino == now.st_ino)
+			return fd;
+		close(fd);
+	}
+}
+
+#endif
+
+struct image_format *image_format_by_name(char *name)
+{
+	char *end = name + strlen(name) - pack_ext_len(name); /* Skip .gz */
+	char *ext = end;
+	int x;
+	while (ext != name && ext[-1] != '.')
+		--ext;
+	for (x = 0; image_formats[x]; ++x) {
+		char *s = image_formats[x]->name;
+		char *t = ext;
+		/* Case insensitive compare */
+		while (*s && t != end && (*t == *s || *t == *s - 'a' + 'A'))
+			++s, ++t;
+		if (!*s && t == end)
+			return image_formats[x];
+	}
+	return 0;
+}
+
+static struct image *image_new(char *name)
+{
+	struct image *img = (struct image *)malloc(sizeof(struct image));
+	memset(img, 0, sizeof(struct image));
+	img->name = strdup(name);
+	img->lock_fd = -1;
+	return img;
+}
+
+static void image_free(struct image *img)
+{
+	if (img->fmt && img->fmt->close)
+		img->fmt->close(img);
+#ifdef HAVE_MMAP
+	if (img->mapped)
+		munmap(img->raw, img->size);
+	else
+#endif
+	if (img->raw)
+		free(img->raw);
+#ifdef HAVE_FLOCK
+	if (img->lock_fd >= 0)
+		close(img->lock_fd);
+#endif
+	if (img->dirty)
+		free(img->dirty);
+	free(img->name);
+	free(img);
+}
+
+/* Read a member of a .zip archive */
+
+static unsigned char *load_zip_member(char *name, long *size)
+{
+	char *path;
+	char *arc = zip_split(name, &path);
+	struct zip *zip;
+	struct zip_member *m;
+	unsigned char *raw = 0;
+
+	if (!(zip = zip_open(arc))) {
+		free(arc);
+		return 0;
+	}
+	if (!(m = zip_find(zip, path)))
+		fprintf(stderr, "'%s' is not in '%s'\n", path, arc);
+	else
+		raw = zip_read(zip, m, size);
+	zip_close(zip);
+	free(arc);
+	return raw;
+}
+
+static struct image *open_raw(char *name, unsigned char *raw, long size, int rdonly, int mapped, int lock_fd);
+
+struct image *image_open(char *name, int rdonly)
+{
+	unsigned char *raw;
+	long size;
+	char *path;
+	char *arc;
+	int lock_fd = -1;
+
+	if ((arc = zip_split(name, &path))) {
+		/* Members of .zip archives can't be written back */
+		free(arc);
+		raw = load_zip_member(name, &size);
+		rdonly = 1;
+	} else {
+#ifdef HAVE_FLOCK
+		if ((lock_fd = image_lock(name, !rdonly)) == -2)
+			return 0;
+#endif
+#ifdef HAVE_MMAP
+		if (rdonly && (raw = map_file(name, &size))) {
+			/* Compressed files have to be read and decompressed */
+			if (pack_detect(raw, size) == PACK_NONE)
+				return open_raw(name, raw, size, rdonly, 1, lock_fd);
+			munmap(raw, size);
+		}
+#endif
+		raw = load_file(name, &size);
+	}
+	if (!raw) {
+#ifdef HAVE_FLOCK
+		if (lock_fd >= 0)
+			close(lock_fd);
+#endif
+		return 0;
+	}
+	return open_raw(name, raw, size, rdonly, 0, lock_fd);
+}
+
+struct image *image_open_mem(char *name, unsigned char *raw, long size, int rdonly)
+{
+	return open_raw(name, raw, size, rdonly, 0, -1);
+}
+
+static struct image *open_raw(char *name, unsigned char *raw, long size, int rdonly, int mapped, int lock_fd)
+{
+	struct image *img;
+	int best = 0;
+	int x;
+
+	img = image_new(name);
+	img->rdonly = rdonly;
+	img->raw = raw;
+	img->size = size;
+	img->mapped = mapped;
+	img->lock_fd = lock_fd;
+	if ((img->pack = unpack(name, &img->raw, &img->size)) == -1) {
+		image_free(img);
+		return 0;
+	}
+
+	/* Detect format: a magic number beats a plausible size */
+	for (x = 0; image_formats[x]; ++x) {
+		int score = image_formats[x]->probe(img->raw, img->size);
+		if (score > best) {
+			best = score;
+			img->fmt = image_formats[x];
+		}
+	}
+	if (!img->fmt) {
+		fprintf(stderr, "'%s' is not a disk image I know about\n", name);
+		image_free(img);
+		return 0;
+	}
+
+	if (img->fmt->open(img)) {
+		fprintf(stderr, " (trying to open %s image '%s')\n", img->fmt->name, name);
+		image_free(img);
+		return 0;
+	}
+	if (!img->fmt->write_sect)
+		img->rdonly = 1;
+	img->dirty = (unsigned char *)calloc(img->nsects + 1, 1);
+	return img;
+}
+
+struct image *image_create(char *name, struct image_format *fmt, int sec_size, int nsects, int layout)
+{
+	struct image *img;
+	if (!fmt)
+		fmt = image_format_by_name(name);
+	if (!fmt)
+		fmt = &atr_format;
+	if (!fmt->create || !fmt->write_sect) {
+		fprintf(stderr, "Can't write %s images\n", fmt->name);
+		return 0;
+	}
+	img = image_new(name);
+#ifdef HAVE_FLOCK
+	if ((img->lock_fd = image_lock(name, 1)) == -2) {
+		image_free(img);
+		return 0;
+	}
+#endif
+	img->fmt = fmt;
+	img->sec_size = sec_size;
+	img->nsects = nsects;
+	img->layout = layout;
+	img->pack = pack_by_name(name);
+	if (fmt->create(img)) {
+		fprintf(stderr, " (trying to create %s image '%s')\n", fmt->name, name);
+		image_free(img);
+		return 0;
+	}
+	img->dirty = (unsigned char *)calloc(img->nsects + 1, 1);
+	img->changed = 1;
+	return img;
+}
+
+int image_sect_size(struct image *img, int sect)
+{
+	if (img->sec_size == 256 && sect <= 3 && !img->full_boot)
+		return 128;
+	else
+		return img->sec_size;
+}
+
+int image_full_boot(struct image *img)
+{
+	if (img->fmt == &imd_format || (img->fmt->encode == 0 && img->layout == ATR_PHYSICAL)) {
+		img->full_boot = 1;
+		return 0;
+	}
+	return -1;
+}
+
+int image_read(struct image *img, unsigned char *buf, int sect)
+{
+	if (sect < 1 || sect > img->nsects)
+		return -1;
+	return img->fmt->read_sect(img, buf, sect);
+}
+
+int image_write(struct image *img, unsigned char *buf, int sect)
+{
+	if (img->rdonly || sect < 1 || sect > img->nsects)
+		return -1;
+	if (img->fmt->write_sect(img, buf, sect))
+		return -1;
+	img->dirty[sect] = 1;
+	return 0;
+}
+
+/* Offset to sector in raw .ATR or .XFD file, -1 if it's past the end */
+
+static long raw_offset(struct image *img, int sect)
+{
+	long ofst;
+	if (img->sec_size == 256 && sect <= 3 && img->layout != ATR_PHYSICAL)
+		ofst = 128L * (sect - 1);
+	else if (img->sec_size == 256 && img->layout == ATR_LOGICAL)
+		ofst = 384 + 256L * (sect - 4);
+	else
+		ofst = (long)img->sec_size * (sect - 1);
+	ofst += img->offset;
+	if (ofst + image_sect_size(img, sect) > img->size)
+		return -1;
+	return ofst;
+}
+
+int image_flush(struct image *img)
+{
+	FILE *f;
+	char *tmp = 0;
+#ifdef HAVE_FLOCK
+	int fd = -1;
+#endif
+	int x;
+
+	if (img->rdonly)
+		return 0;
+
+	/* Atomic update writes the whole file */
+	if (img->atomic)
+		for (x = 1; x <= img->nsects; ++x)
+			if (img->dirty[x])
+				img->changed = 1;
+
+	/* Re-encode (and recompress) if there are any changes */
+	if (img->fmt->encode || img->pack) {
+		for (x = 1; x <= img->nsects; ++x)
+			if (img->dirty[x])
+				img->changed = 1;
+		if (img->changed && img->fmt->encode && img->fmt->encode(img))
+			return -1;
+	}
+
+	if (img->changed) {
+		/* Write whole file */
+		unsigned char *out = img->raw;
+		long len = img->size;
+		if (img->pack && !(out = pack(img->pack, img->raw, img->size, &len)))
+			return -1;
+		if (img->atomic) {
+			tmp = (char *)malloc(strlen(img->name) + 5);
+			sprintf(tmp, "%s.new", img->name);
+		}
+		f = fopen(tmp ? tmp : img->name, "wb");
+		if (!f) {
+			fprintf(stderr, "Couldn't open '%s' for writing\n", tmp ? tmp : img->name);
+			if (out != img->raw)
+				free(out);
+			free(tmp);
+			return -1;
+		}
+		if (len && 1 != fwrite(out, len, 1, f)) {
+			fprintf(stderr, "Couldn't write '%s'\n", tmp ? tmp : img->name);
+			fclose(f);
+			if (tmp)
+				remove(tmp);
+			if (out != img->raw)
+				free(out);
+			free(tmp);
+			return -1;
+		}
+		if (out != img->raw)
+			free(out);
+	} else {
+		/* Write only modified sectors */
+		f = 0;
+		for (x = 1; x <= img->nsects; ++x) {
+			long ofst;
+			if (!img->dirty[x])
+				continue;
+			if (!f && !(f = fopen(img->name, "r+b"))) {
+				fprintf(stderr, "Couldn't open '%s' for writing\n", img->name);
+				return -1;
+			}
+			ofst = raw_offset(img, x);
+			if (fseek(f, ofst, SEEK_SET) || 1 != fwrite(img->raw + ofst, image_sect_size(img, x), 1, f)) {
+				fprintf(stderr, "Couldn't write sector %d of '%s'\n", x, img->name);
+				fclose(f);
+				return -1;
+			}
+		}
+		if (!f)
+			return 0;
+	}
+	if (fclose(f)) {
+		fprintf(stderr, "Couldn't write '%s'\n", tmp ? tmp : img->name);
+		if (tmp)
+			remove(tmp);
+		free(tmp);
+		return -1;
+	}
+	if (tmp) {
+#ifdef HAVE_FLOCK
+		/* Lock the new file before it replaces the old one, so we keep
+		   the image locked */
+		if (img->lock_fd >= 0 && (fd = open(tmp, O_RDONLY)) >= 0 && flock(fd, LOCK_EX | LOCK_NB)) {
+			close(fd);
+			fd = -1;
+		}
+#endif
+		if (rename(tmp, img->name)) {
+			fprintf(stderr, "Couldn't rename '%s' to '%s'\n", tmp, img->name);
+			remove(tmp);
+			free(tmp);
+#ifdef HAVE_FLOCK
+			if (fd >= 0)
+				close(fd);
+#endif
+			return -1;
+		}
+		free(tmp);
+#ifdef HAVE_FLOCK
+		if (fd >= 0) {
+			close(img->lock_fd);
+			img->lock_fd = fd;
+		}
+#endif
+	}
+	img->changed = 0;
+	memset(img->dirty, 0, img->nsects + 1);
+	return 0;
+}
+
+int image_close(struct image *img)
+{
+	int rtn = image_flush(img);
+	image_free(img);
+	return rtn;
+}
+
+void image_discard(struct image *img)
+{
+	img->changed = 0;
+	memset(img->dirty, 0, img->nsects + 1);
+}
+
+/* Formats which keep decoded sectors in img->data */
+
+int image_data_read(struct image *img, unsigned char *buf, int sect)
+{
+	memcpy(buf, img->data + (long)img->sec_size * (sect - 1), image_sect_size(img, sect));
+	return 0;
+}
+
+int image_data_write(struct image *img, unsigned char *buf, int sect)
+{
+	memcpy(img->data + (long)img->sec_size * (sect - 1), buf, image_sect_size(img, sect));
+	return 0;
+}
+
+/* Sector access for .ATR and .XFD: sectors are read and written in raw */
+
+static int raw_read(struct image *img, unsigned char *buf, int sect)
+{
+	long ofst = raw_offset(img, sect);
+	if (ofst == -1)
+		return -1;
+	memcpy(buf, img->raw + ofst, image_sect_size(img, sect));
+	return 0;
+}
+
+static int raw_write(struct image *img, unsigned char *buf, int sect)
+{
+	long ofst = raw_offset(img, sect);
+	if (ofst == -1)
+		return -1;
+	memcpy(img->raw + ofst, buf, image_sect_size(img, sect));
+	return 0;
+}
+
+/* Size of sector data for a geometry and layout */
+
+static long raw_size(int sec_size, int nsects, int layout)
+{
+	if (sec_size == 256 && layout == ATR_LOGICAL)
+		return 384 + 256L * (nsects - 3);
+	else
+		return (long)sec_size * nsects;
+}
+
+/* Set geometry of 256 byte sector image from size of sector data */
+
+static void raw_dd_geometry(struct image *img, long len)
+{
+	img->sec_size = 256;
+	if ((len >> 7) & 1) {
+		/* Odd number of 128 byte chunks: first three sectors are 128 bytes */
+		img->layout = ATR_LOGICAL;
+		img->nsects = 3 + (len - 384) / 256;
+	} else {
+		long x;
+		int flg = 0;
+		for (x = 384; x != 768 && img->offset + x < img->size; ++x)
+			if (img->raw[img->offset + x])
+				flg = 1;
+		/* Bytes 384 - 768 are all zeros.  SIO2PC does this */
+		img->layout = flg ? ATR_PHYSICAL : ATR_SIO;
+		img->nsects = len / 256;
+	}
+}
+
+/* .ATR: 16 byte header, then sectors */
+
+static int atr_probe(unsigned char *raw, long size)
+{
+	if (size >= 16 && raw[0] == 0x96 && raw[1] == 0x02)
+		return 2;
+	return 0;
+}
+
+static int atr_open(struct image *img)
+{
+	int sec_size = img->raw[4] + (img->raw[5] << 8);
+	long len = img->size - 16;
+	img->offset = 16;
+	/* Get image size from file, don't trust size from header */
+	if (sec_size == 128 || sec_size == 256) {
+	} else if (len == 128 * 3 + 256 * 717) {
+		sec_size = 256;
+	} else {
+		fprintf(stderr, "Unknown sector size %d\n", sec_size);
+		return -1;
+	}
+	if (sec_size == 256 && len >= 768) {
+		raw_dd_geometry(img, len);
+	} else {
+		img->sec_size = 128;
+		img->nsects = len / 128;
+	}
+	return 0;
+}
+
+static int atr_create(struct image *img)
+{
+	long len = raw_size(img->sec_size, img->nsects, img->layout);
+	img->offset = 16;
+	img->size = 16 + len;
+	img->raw = (unsigned char *)calloc(img->size, 1);
+	if (!img->raw) {
+		fprintf(stderr, "Couldn't allocate space for image\n");
+		return -1;
+	}
+	img->raw[0] = 0x96;
+	img->raw[1] = 0x02;
+	img->raw[2] = (len >> 4);
+	img->raw[3] = (len >> 12);
+	img->raw[4] = img->sec_size;
+	img->raw[5] = (img->sec_size >> 8);
+	img->raw[6] = (len >> 20);
+	return 0;
+}
+
+struct image_format atr_format = {
+	"atr", "Atari SIO2PC disk image",
+	atr_probe, atr_open, atr_create, raw_read, raw_write, 0, 0
+};
+
+/* .XFD: just the sectors, geometry from the size */
+
+static int xfd_probe(unsigned char *raw, long size)
+{
+	(void)raw;
+	if (size && !(size & 127))
+		return 1;
+	return 0;
+}
+
+static int xfd_open(struct image *img)
+{
+	img->offset = 0;
+	if (img->size == 128 * 3 + 256 * 717 || img->size == 256 * 720)
+		raw_dd_geometry(img, img->size);
+	else {
+		img->sec_size = 128;
+		img->nsects = img->size / 128;
+	}
+	return 0;
+}
+
+static int xfd_create(struct image *img)
+{
+	img->offset = 0;
+	img->size = raw_size(img->sec_size, img->nsects, img->layout);
+	img->raw = (unsigned char *)calloc(img->size + 1, 1);
+	if (!img->raw) {
+		fprintf(stderr, "Couldn't allocate space for image\n");
+		return -1;
+	}
+	return 0;
+}
+
+struct image_format xfd_format = {
+	"xfd", "Raw sectors, no header",
+	xfd_probe, xfd_open, xfd_create, raw_read, raw_write, 0, 0
+};
+
+/* .IMD: ImageDisk tracks, sectors are interleaved and inverted */
+
+static int imd_probe(unsigned char *raw, long size)
+{
+	/* ImageDisk writes "IMD ", our own atr2imd writes "ATR2IMD " */
+	if ((size >= 4 && !memcmp(raw, "IMD ", 4)) || (size >= 8 && !memcmp(raw, "ATR2IMD ", 8)))
+		return 2;
+	return 0;
+}
+
+static int imd_open(struct image *img)
+{
+	if (!(img->imd = imd_decode(img->raw, img->size)))
+		return -1;
+	if (!img->imd->ntracks) {
+		fprintf(stderr, "No tracks\n");
+		return -1;
+	}
+	img->sec_size = img->imd->tracks->sec_size;
+	if (img->sec_size != 128 && img->sec_size != 256) {
+		fprintf(stderr, "Unknown sector size %d\n", img->sec_size);
+		return -1;
+	}
+	img->nsects = img->imd->ntracks * img->imd->tracks->sects;
+	return 0;
+}
+
+static int imd_create(struct image *img)
+{
+	char comment[80];
+	time_t t = time(NULL);
+	struct tm *tm = localtime(&t);
+	int sects;
+
+	sprintf(comment, "IMD 1.18: %2.2d/%2.2d/%4.4d %2.2d:%2.2d:%2.2d\n",
+	       tm->tm_mday,tm->tm_mon + 1,tm->tm_year + 1900,tm->tm_hour,
+	       tm->tm_min,tm->tm_sec);
+
+	if (img->sec_size == 256) {
+		sects = 18;
+		img->imd = imd_new(comment, (img->nsects + sects - 1) / sects, sects, 256, 5, hd_map);
+	} else if (img->nsects > 18 * 40) {
+		sects = 26;
+		img->imd = imd_new(comment, (img->nsects + sects - 1) / sects, sects, 128, 5, dd_map);
+	} else {
+		sects = 18;
+		img->imd = imd_new(comment, (img->nsects + sects - 1) / sects, sects, 128, 2, sd_map);
+	}
+	img->nsects = img->imd->ntracks * sects;
+	return 0;
+}
+
+static int imd_read(struct image *img, unsigned char *buf, int sect)
+{
+	unsigned char *p = imd_sector(img->imd, sect);
+	int size = image_sect_size(img, sect);
+	if (!p)
+		return -1;
+	memcpy(buf, p, size);
+	invert(buf, size);
+	return 0;
+}
+
+static int imd_write(struct image *img, unsigned char *buf, int sect)
+{
+	unsigned char *p = imd_sector(img->imd, sect);
+	int size = image_sect_size(img, sect);
+	if (!p)
+		return -1;
+	memcpy(p, buf, size);
+	invert(p, size);
+	return 0;
+}
+
+static int imd_encode_image(struct image *img)
+{
+	long len;
+	unsigned char *raw = imd_encode(img->imd, &len);
+	if (!raw)
+		return -1;
+	if (img->raw)
+		free(img->raw);
+	img->raw = raw;
+	img->size = len;
+	return 0;
+}
+
+static void imd_close(struct image *img)
+{
+	if (img->imd)
+		free_imd(img->imd);
+}
+
+struct image_format imd_format = {
+	"imd", "ImageDisk",
+	imd_probe, imd_open, imd_create, imd_read, imd_write, imd_encode_image, imd_close
+};
@@ -0,0 +1,167 @@
+/*	Disk image formats
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _Iimage
+#define _Iimage 1
+
+/* An image is read completely into memory when it's opened.  Sectors are
+ * read and written in memory, and the file is updated when the image is
+ * flushed or closed.  For formats where sectors are stored plainly (.ATR,
+ * .XFD) only the modified sectors are written back.  Other formats are
+ * encoded again and written in full, as are compressed (.gz, .zst) files.
+ *
+ * Sectors are numbered starting with 1, as the drive numbers them.  On
+ * disks with 256 byte sectors, sectors 1 - 3 are 128 bytes.
+ */
+
+/* How the first three sectors of a 256 byte sector .ATR image are stored */
+#define ATR_LOGICAL 0 /* 128 bytes each */
+#define ATR_SIO 1 /* 128 bytes each, then 384 bytes of zeros */
+#define ATR_PHYSICAL 2 /* 256 bytes each, only first 128 are used */
+
+struct image_format;
+
+/* An open disk image */
+
+struct image {
+	struct image_format *fmt;
+	char *name; /* File name */
+	int rdonly; /* Set if writing is not allowed */
+
+	/* Geometry */
+	int sec_size; /* 128 or 256 */
+	int nsects; /* Number of sectors */
+
+	/* The image file */
+	unsigned char *raw; /* File contents */
+	long size; /* Size of file contents */
+	unsigned char *dirty; /* Flag for each sector: set if it needs to be written back */
+	int changed; /* Set if the whole file needs to be written back */
+	int full_boot; /* Set to access all 256 bytes of sectors 1 - 3 */
+	int pack; /* How the file is compressed: PACK_NONE, PACK_GZIP or PACK_ZSTD */
+	int atomic; /* Set to write changes to a new file which is renamed over
+	               the old one, so readers never see a partly updated image */
+	int mapped; /* Set if raw is a read only mapping of the file, not malloc */
+	int lock_fd; /* File descriptor holding the lock on the file, -1 if none */
+
+	/* Format specific */
+	int layout; /* ATR_LOGICAL, ATR_SIO or ATR_PHYSICAL */
+	long offset; /* Offset to sector data in raw: .ATR header size */
+	unsigned char *data; /* Decoded sectors, sec_size apart */
+	struct imd *imd; /* Decoded .IMD tracks */
+};
+
+/* An image format */
+
+struct image_format {
+	char *name; /* Short name, also the file name extension */
+	char *desc; /* Description */
+
+	/* Check if raw looks like this format.  Return 2 for a magic number
+	   match, 1 if it's only plausible (right size) or 0 if not. */
+	int (*probe)(unsigned char *raw, long size);
+
+	/* Decode img->raw: set geometry, return non-zero on error */
+	int (*open)(struct image *img);
+
+	/* Create a new empty image with the geometry in img, return non-zero on error */
+	int (*create)(struct image *img);
+
+	/* Read and write a sector, return non-zero on error.  Leave write_sect
+	   NULL if the format can not be written. */
+	int (*read_sect)(struct image *img, unsigned char *buf, int sect);
+	int (*write_sect)(struct image *img, unsigned char *buf, int sect);
+
+	/* Encode decoded sectors back into img->raw before it's written.  NULL
+	   if raw is kept up to date by write_sect. */
+	int (*encode)(struct image *img);
+
+	/* Free format specific data */
+	void (*close)(struct image *img);
+};
+
+/* All known formats, NULL terminated */
+extern struct image_format *image_formats[];
+
+extern struct image_format atr_format;
+extern struct image_format xfd_format;
+extern struct image_format dcm_format;
+extern struct image_format imd_format;
+
+/* Find format by name or from file name extension, returns NULL if not found */
+struct image_format *image_format_by_name(char *name);
+
+/* Open an image: the format is detected from its contents.  name can also
+   be archive.zip:path/inside.atr for an image in a .zip archive (these are
+   always read only).  Returns NULL on error.
+
+   A read only image which isn't compressed is mapped instead of read, so
+   processes reading the same image share its pages.  The file is locked
+   (advisory) until the image is closed: shared if it's read only, so any
+   number of readers can have it open, otherwise exclusive.  If another
+   process has a conflicting lock, we wait for image_lock_wait seconds and
+   then fail. */
+struct image *image_open(char *name, int rdonly);
+
+/* Seconds to wait for a lock: 0 to fail right away, -1 to wait forever */
+extern int image_lock_wait;
+
+/* Open a file and lock it like image_open() does (with -DHAVE_FLOCK).
+   Returns file descriptor holding the lock, -1 if the file couldn't be
+   opened or -2 if it couldn't be locked (message has been printed). */
+int image_lock(char *name, int excl);
+
+/* Open an image which has already been read into memory: raw is a malloc
+   block which now belongs to the image.  name is used when it's written
+   back. */
+struct image *image_open_mem(char *name, unsigned char *raw, long size, int rdonly);
+
+/* Create a new image (existing file is locked and replaced when it's
+   flushed).  If fmt
+   is NULL, the format is chosen from the file name extension (.atr if
+   none match).  layout is used for 256 byte sector .ATR images.  If the
+   name ends with .gz or .zst, the file is written compressed. */
+struct image *image_create(char *name, struct image_format *fmt, int sec_size, int nsects, int layout);
+
+/* Size of a sector in bytes */
+int image_sect_size(struct image *img, int sect);
+
+/* Access all 256 bytes of the first three sectors on 256 byte sector disks
+   (normally only the first 128 are used).  Returns non-zero if the format
+   doesn't store them. */
+int image_full_boot(struct image *img);
+
+/* Read and write sectors, return non-zero on error */
+int image_read(struct image *img, unsigned char *buf, int sect);
+int image_write(struct image *img, unsigned char *buf, int sect);
+
+/* Write changes back to the file, return non-zero on error */
+int image_flush(struct image *img);
+
+/* Flush and free image, return non-zero on error */
+int image_close(struct image *img);
+
+/* Forget changes made since the last flush: they are not written back.
+   Sectors read before the image is closed may still have them. */
+void image_discard(struct image *img);
+
+/* Sector data helpers for formats which keep a decoded sector array in data */
+int image_data_read(struct image *img, unsigned char *buf, int sect);
+int image_data_write(struct image *img, unsigned char *buf, int sect);
+
+#endif
@@ -0,0 +1,426 @@
+/* ImageDisk (.IMD) file reader
+ *
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the 
+ * terms of the GNU General Public License as published by the Free Software 
+ * Foundation; either version 1, or (at your option) any later version.  
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY 
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS 
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more 
+ * details.  
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation, 
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "imd.h"
+
+void free_imd(struct imd *imd)
+{
+	struct track *t;
+	while ((t = imd->tracks)) {
+		imd->tracks = t->next;
+		if (t->map)
+			free(t->map);
+		if (t->data)
+			free(t->data);
+		free(t);
+	}
+	if (imd->comment)
+		free(imd->comment);
+	if (imd->index)
+		free(imd->index);
+	free(imd);
+}
+
+/* Read from an in-memory .IMD file */
+
+struct mfile {
+	unsigned char *p;
+	long left;
+};
+
+static int mgetc(struct mfile *f)
+{
+	if (!f->left)
+		return -1;
+	--f->left;
+	return *f->p++;
+}
+
+static int mread(unsigned char *buf, long len, struct mfile *f)
+{
+	if (f->left < len)
+		return 0;
+	memcpy(buf, f->p, len);
+	f->p += len;
+	f->left -= len;
+	return 1;
+}
+
+struct imd *imd_decode(unsigned char *raw, long len)
+{
+	struct imd *imd;
+	struct track *track;
+	struct track *last;
+	char buf[1024];
+	int x;
+	int c;
+	struct mfile mf[1];
+	struct mfile *f = mf;
+	mf->p = raw;
+	mf->left = len;
+	last = 0;
+
+	/* Read header */
+	x = 0;
+	while ((c = mgetc(f)), (c != -1 && c != 0x1A)) {
+		if (x < (int)sizeof(buf) - 1)
+			buf[x++] = c;
+	}
+	buf[x] = 0;
+
+	if (!x) {
+		fprintf(stderr, "No header?\n");
+		return 0;
+	}
+
+	imd = (struct imd *)malloc(sizeof(struct imd));
+	imd->comment = strdup(buf);
+	imd->tracks = 0;
+	imd->ntracks = 0;
+	imd->index = 0;
+
+	/* Read tracks */
+	while ((c = mgetc(f)), (c != -1)) {
+		int x;
+		if (c < 0 || c > 5) {
+			fprintf(stderr,"Invalid mode byte?\n");
+			free_imd(imd);
+			return 0;
+		}
+//		printf("track\n");
+		track = (struct track *)malloc(sizeof(struct track));
+		track->data = 0;
+		track->map = 0;
+		track->next = 0;
+		track->mode = c;
+		c = mgetc(f);
+		if (c < 0 || c > 80) {
+			fprintf(stderr,"Invalid cylinder number\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->cyl = c;
+		c = mgetc(f);
+		if (c < 0 || c > 1) {
+			fprintf(stderr,"Invalid head number\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->head = c;
+		c = mgetc(f);
+		if (c < 1) {
+			fprintf(stderr,"Invalid number of sectors\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->sects = c;
+		c = mgetc(f);
+		if (c < 0 || c > 6) {
+			fprintf(stderr,"Invalid sector size\n");
+			free_imd(imd);
+			return 0;
+		}
+		track->sec_size = (128 << c);
+		track->map = (unsigned char *)malloc(track->sects);
+		if (!mread(track->map, track->sects, f)) {
+			fprintf(stderr,"Couldn't read sector map\n");
+			free_imd(imd);
+			return 0;
+		}
+		memset(track->slot, 0xFF, sizeof(track->slot));
+		for (x = 0; x != track->sects; ++x)
+			track->slot[track->map[x]] = x;
+		track->data = (unsigned char *)malloc(track->sects * track->sec_size);
+		for (x = 0; x != track->sects; ++x) {
+			c = mgetc(f);
+			if (c < 0 || c > 8) {
+				fprintf(stderr,"Invalid sector type\n");
+				free_imd(imd);
+				return 0;
+			}
+			if (c & 1) {
+				if (!mread(track->data + x * track->sec_size, track->sec_size, f)) {
+					fprintf(stderr,"Couldn't read sectors\n");
+					free_imd(imd);
+					return 0;
+				}
+			} else if (c == 0) {
+				memset(track->data + x * track->sec_size, 0, track->sec_size);
+			} else {
+				c = mgetc(f);
+				if (c < 0) {
+					fprintf(stderr,"Couldn't compressed sector\n");
+					free_imd(imd);
+					return 0;
+				}
+				memset(track->data + x * track->sec_size, c, track->sec_size);
+			}
+		}
+		if (last) {
+			last->next = track;
+			last = track;
+		} else {
+			last = imd->tracks = track;
+		}
+		++imd->ntracks;
+	}
+
+	/* Index tracks for sector lookup */
+	imd->index = (struct track **)malloc(sizeof(struct track *) * (imd->ntracks + 1));
+	for (x = 0, track = imd->tracks; track; track = track->next)
+		imd->index[x++] = track;
+	return imd;
+}
+
+/* Read a .IMD file */
+
+struct imd *read_imd(char *name)
+{
+	struct imd *imd;
+	unsigned char *raw;
+	long len;
+	FILE *f = fopen(name, "rb");
+
+	if (!f) {
+		fprintf(stderr, "Couldn't open %s\n", name);
+		return 0;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	raw = (unsigned char *)malloc(len + 1);
+	if (len < 0 || (len && 1 != fread(raw, len, 1, f))) {
+		fprintf(stderr, "Couldn't read %s\n", name);
+		free(raw);
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	imd = imd_decode(raw, len);
+	free(raw);
+	return imd;
+}
+
+long imd_size(struct imd *imd)
+{
+	long size = 0;
+	struct track *t;
+	for (t = imd->tracks; t; t = t->next) {
+		size += t->sec_size * t->sects;
+	}
+	return size;
+}
+
+unsigned char *imd_sector(struct imd *imd, int sect)
+{
+	struct track *t;
+	int y;
+	if (sect < 1 || !imd->ntracks)
+		return 0;
+	/* Atari disks have the same number of sectors on every track */
+	sect -= 1;
+	y = sect / imd->tracks->sects;
+	if (y >= imd->ntracks)
+		return 0;
+	t = imd->index[y];
+	y = sect % imd->tracks->sects + 1;
+	if (y > 255 || t->slot[y] == 0xFF)
+		return 0;
+	return t->data + t->sec_size * t->slot[y];
+}
+
+/* Interleave map for 90K disks */
+int sd_map[] = 
+  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 2, 4, 6, 8, 10, 12, 14, 16, 18 };
+
+/* Interleave map for 130K disks */
+int dd_map[] =
+  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26 };
+
+/* Interleave map for 180K disks */
+int hd_map[] = 
+  { 1, 3, 5, 7, 9, 11, 13, 15, 17, 2, 4, 6, 8, 10, 12, 14, 16, 18 };
+
+/* Create an empty (all zero as seen by the Atari) disk */
+
+struct imd *imd_new(char *comment, int cyls, int sects, int sec_size, int mode, int *map)
+{
+	struct imd *imd;
+	struct track *last = 0;
+	int cyl;
+	int x;
+
+	imd = (struct imd *)malloc(sizeof(struct imd));
+	imd->comment = strdup(comment);
+	imd->tracks = 0;
+	imd->ntracks = 0;
+	imd->index = (struct track **)malloc(sizeof(struct track *) * (cyls + 1));
+
+	for (cyl = 0; cyl != cyls; ++cyl) {
+		struct track *t = (struct track *)malloc(sizeof(struct track));
+		t->next = 0;
+		t->mode = mode;
+		t->sec_size = sec_size;
+		t->head = 0;
+		t->cyl = cyl;
+		t->sects = sects;
+		t->map = (unsigned char *)malloc(sects);
+		t->data = (unsigned char *)malloc(sects * sec_size);
+		memset(t->data, 0xFF, sects * sec_size);
+		memset(t->slot, 0xFF, sizeof(t->slot));
+		for (x = 0; x != sects; ++x) {
+			t->map[x] = map[x];
+			t->slot[map[x]] = x;
+		}
+		if (last)
+			last->next = t;
+		else
+			imd->tracks = t;
+		last = t;
+		imd->index[imd->ntracks++] = t;
+	}
+	return imd;
+}
+
+/* True if all bytes are the same */
+
+static int is_same(unsigned char *data, int len)
+{
+	int c = data[0];
+	int x;
+	for (x = 1; x != len; ++x)
+		if (data[x] != c)
+			return 0;
+	return 1;
+}
+
+/* Generate .IMD file, returns malloc block */
+
+unsigned char *imd_encode(struct imd *imd, long *len)
+{
+	struct track *t;
+	long size = strlen(imd->comment) + 1;
+	unsigned char *raw;
+	unsigned char *p;
+
+	for (t = imd->tracks; t; t = t->next)
+		size += 5 + t->sects + t->sects * (1 + t->sec_size);
+	p = raw = (unsigned char *)malloc(size);
+	if (!raw) {
+		fprintf(stderr, "Couldn't allocate space for image\n");
+		return 0;
+	}
+
+	/* Comment */
+	memcpy(p, imd->comment, strlen(imd->comment));
+	p += strlen(imd->comment);
+	*p++ = 0x1A;
+
+	/* Tracks */
+	for (t = imd->tracks; t; t = t->next) {
+		int x;
+		*p++ = t->mode;
+		*p++ = t->cyl;
+		*p++ = t->head;
+		*p++ = t->sects;
+		for (x = 0; (128 << x) < t->sec_size; ++x);
+		*p++ = x;
+		/* Sector map */
+		memcpy(p, t->map, t->sects);
+		p += t->sects;
+		/* Cylinder map (empty) */
+		/* Head map (empty) */
+		/* Sectors */
+		for (x = 0; x != t->sects; ++x) {
+			unsigned char *d = t->data + x * t->sec_size;
+			if (is_same(d, t->sec_size)) {
+				*p++ = 2;
+				*p++ = d[0];
+			} else {
+				*p++ = 1;
+				memcpy(p, d, t->sec_size);
+				p += t->sec_size;
+			}
+		}
+	}
+	*len = p - raw;
+	return raw;
+}
+
+/* Write a .IMD file */
+
+int write_imd(struct imd *imd, char *name)
+{
+	long len;
+	unsigned char *raw = imd_encode(imd, &len);
+	FILE *f;
+	if (!raw)
+		return 1;
+	f = fopen(name, "wb");
+	if (!f) {
+		fprintf(stderr, "Couldn't open %s for writing\n", name);
+		free(raw);
+		return 1;
+	}
+	if (1 != fwrite(raw, len, 1, f)) {
+		fprintf(stderr, "Couldn't write %s\n", name);
+		fclose(f);
+		free(raw);
+		return 1;
+	}
+	free(raw);
+	if (fclose(f)) {
+		fprintf(stderr, "Couldn't write %s\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+/* Invert sector data.  IMD stores the complement of what the Atari sees.
+   Work a vector (or machine word) at a time, it's most of the run time. */
+
+void invert(unsigned char *buf, long len)
+{
+#ifdef __SSE2__
+	__m128i ones = _mm_set1_epi8(-1);
+	while (len >= 16) {
+		_mm_storeu_si128((__m128i *)buf, _mm_xor_si128(_mm_loadu_si128((__m128i *)buf), ones));
+		buf += 16;
+		len -= 16;
+	}
+#else
+	while (len >= (long)sizeof(unsigned long)) {
+		unsigned long w;
+		memcpy(&w, buf, sizeof(w));
+		w = ~w;
+		memcpy(buf, &w, sizeof(w));
+		buf += sizeof(w);
+		len -= sizeof(w);
+	}
+#endif
+	while (len--)
+		*buf++ ^= 0xFF;
+}
+
@@ -0,0 +1,88 @@
+/* ImageDisk (.IMD) file reader
+ *
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the 
+ * terms of the GNU General Public License as published by the Free Software 
+ * Foundation; either version 1, or (at your option) any later version.  
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY 
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS 
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more 
+ * details.  
+ * 
+ * You should have received a copy of the GNU General Public License along with 
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation, 
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _Iimd
+#define _Iimd 1
+
+/* A track */
+
+struct track {
+	struct track *next;
+	int mode; /*
+		0 = 500 kbps FM
+		1 = 300 kbps FM
+		2 = 250 kbps FM
+		3 = 500 kbps MFM
+		4 = 300 kbps MFM
+		5 = 250 kbps MFM */
+	int sec_size;
+	int head;
+	int cyl;
+	int sects;
+	unsigned char *map;
+	unsigned char *data;
+	unsigned char slot[256]; /* Sector number to position in track, 0xFF if missing */
+};
+
+/* A loaded .IMD file */
+
+struct imd {
+	char *comment;
+	struct track *tracks;
+	int ntracks;
+	struct track **index; /* Tracks in file order, for sector lookup */
+};
+
+/* Read a .IMD file, returns 0 on error */
+struct imd *read_imd(char *name);
+
+/* Parse an in-memory .IMD file, returns 0 on error */
+struct imd *imd_decode(unsigned char *raw, long len);
+
+/* Generate .IMD file in a malloc block, length returned in len.  Returns 0
+   on error */
+unsigned char *imd_encode(struct imd *imd, long *len);
+
+/* Write a .IMD file, returns non-zero on error */
+int write_imd(struct imd *imd, char *name);
+
+/* Create a disk with all sectors zero (as seen by the Atari).  Comment
+   is the header text.  Map is the interleave: the sector number stored
+   in each position of the track. */
+struct imd *imd_new(char *comment, int cyls, int sects, int sec_size, int mode, int *map);
+
+/* Standard interleave maps for 90K, 130K and 180K disks */
+extern int sd_map[];
+extern int dd_map[];
+extern int hd_map[];
+
+/* Free a loaded .IMD file */
+void free_imd(struct imd *imd);
+
+/* Total size of sector data in bytes */
+long imd_size(struct imd *imd);
+
+/* Find Atari sector number sect (starting at 1).  Returns pointer to
+   its data as stored in the .IMD file (inverted), or 0 if it's missing. */
+unsigned char *imd_sector(struct imd *imd, int sect);
+
+/* Invert sector data */
+void invert(unsigned char *buf, long len);
+
+#endif
@@ -23,181 +23,10 @@
 #include <string.h>
 #include <sys/types.h>
 #include <time.h>
-
-/* A track */
-
-struct track {
-	struct track *next;
-	int mode; /*
-		0 = 500 kbps FM
-		1 = 300 kbps FM
-		2 = 250 kbps FM
-		3 = 500 kbps MFM
-		4 = 300 kbps MFM
-		5 = 250 kbps MFM */
-	int sec_size;
-	int head;
-	int cyl;
-	int sects;
-	unsigned char *map;
-	unsigned char *data;
-};
-
-/* A loaded .IMD file */
-
-struct imd {
-	char *comment;
-	struct track *tracks;
-	int ntracks;
-};
-
-void free_imd(struct imd *imd)
-{
-	struct track *t;
-	while ((t = imd->tracks)) {
-		imd->tracks = t->next;
-		if (t->map)
-			free(t->map);
-		if (t->data)
-			free(t->data);
-		free(t);
-	}
-	if (imd->comment)
-		free(imd->comment);
-	free(imd);
-}
-
-struct imd *read_imd(char *name)
-{
-	struct imd *imd;
-	struct track *track;
-	struct track *last;
-	char buf[1024];
-	int x;
-	int c;
-	FILE *f = fopen(name, "rb");
-	last = 0;
-
-	if (!f) {
-		fprintf(stderr, "Couldn't open %s\n", name);
-		return 0;
-	}
-
-	printf("Converting %s\n", name);
-
-	/* Read header */
-	x = 0;
-	while ((c = fgetc(f)), (c != -1 && c != 0x1A)) {
-		if (x < sizeof(buf) - 1)
-			buf[x++] = c;
-	}
-	buf[x] = 0;
-
-	if (!x) {
-		fprintf(stderr, "No header?\n");
-		fclose(f);
-		return 0;
-	}
-
-	imd = (struct imd *)malloc(sizeof(struct imd));
-	imd->comment = strdup(buf);
-	imd->tracks = 0;
-	imd->ntracks = 0;
-
-	/* Read tracks */
-	while ((c = fgetc(f)), (c != -1)) {
-		int x;
-		if (c < 0 || c > 5) {
-			fprintf(stderr,"Invalid mode byte?\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-//		printf("track\n");
-		track = (struct track *)malloc(sizeof(struct track));
-		track->data = 0;
-		track->map = 0;
-		track->next = 0;
-		track->mode = c;
-		c = fgetc(f);
-		if (c < 0 || c > 80) {
-			fprintf(stderr,"Invalid cylinder number\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->cyl = c;
-		c = fgetc(f);
-		if (c < 0 || c > 1) {
-			fprintf(stderr,"Invalid head number\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->head = c;
-		c = fgetc(f);
-		if (c < 1) {
-			fprintf(stderr,"Invalid number of sectors\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->sects = c;
-		c = fgetc(f);
-		if (c < 0 || c > 6) {
-			fprintf(stderr,"Invalid sector size\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->sec_size = (128 << c);
-		track->map = (unsigned char *)malloc(track->sects);
-		if (1 != fread(track->map, track->sects, 1, f)) {
-			fprintf(stderr,"Couldn't read sector map\n");
-			fclose(f);
-			free_imd(imd);
-			return 0;
-		}
-		track->data = (unsigned char *)malloc(track->sects * track->sec_size);
-		for (x = 0; x != track->sects; ++x) {
-			c = fgetc(f);
-			if (c < 0 || c > 8) {
-				fprintf(stderr,"Invalid sector type\n");
-				fclose(f);
-				free_imd(imd);
-				return 0;
-			}
-			if (c & 1) {
-				if (1 != fread(track->data + x * track->sec_size, track->sec_size, 1, f)) {
-					fprintf(stderr,"Couldn't read sectors\n");
-					fclose(f);
-					free_imd(imd);
-					return 0;
-				}
-			} else if (c == 0) {
-				memset(track->data + x * track->sec_size, 0, track->sec_size);
-			} else {
-				c = fgetc(f);
-				if (c < 0) {
-					fprintf(stderr,"Couldn't compressed sector\n");
-					fclose(f);
-					free_imd(imd);
-					return 0;
-				}
-				memset(track->data + x * track->sec_size, c, track->sec_size);
-			}
-		}
-		if (last) {
-			last->next = track;
-			last = track;
-		} else {
-			last = imd->tracks = track;
-		}
-		++imd->ntracks;
-	}
-	fclose(f);
-	return imd;
-}
+#include "imd.h"
+#include "image.h"
+#include "pack.h"
+#include "zip.h"
 
 char *modes[] =
 {
@@ -224,33 +53,20 @@ void dump_imd(struct imd *imd)
 	}
 }
 
-long imd_size(struct imd *imd)
-{
-	long size = 0;
-	struct track *t;
-	for (t = imd->tracks; t; t = t->next) {
-		size += t->sec_size * t->sects;
-	}
-	return size;
-}
-
-int write_atr(struct imd *imd, char *dest_name, int logical, int sio)
+int write_atr(struct image *src, char *dest_name, struct image_format *fmt, int logical, int sio)
 {
 	FILE *f;
-	struct track *t;
-	unsigned char header[16];
-	unsigned char buf[8192];
-	long size;
+	struct image *img;
+	unsigned char buf[256];
 	int sec_size;
-	int count;
-	count = 0;
+	int layout;
+	int x;
 
-	sec_size = imd->tracks->sec_size;
-	size = imd_size(imd);
+	sec_size = src->sec_size;
 
 	printf("Sector size is %d\n", sec_size);
 
-	if (sec_size == 256) {
+	if (sec_size == 256 && fmt == &atr_format) {
 		if (logical)
 			printf("  Using logical\n");
 		else if (sio)
@@ -259,13 +75,7 @@ int write_atr(struct imd *imd, char *dest_name, int logical, int sio)
 			printf("  Using physical\n");
 	}
 
-	if (size & (sec_size - 1)) {
-		fprintf(stderr,"Invalid .imd file size = %ld bytes\n", size);
-		fprintf(stderr,"It must be multiple of %d\n", sec_size);
-		return 1;
-	} else {
-		printf("Disk size is %ldK\n", size / 1024);
-	}
+	printf("Disk size is %ldK\n", (long)src->nsects * sec_size / 1024);
 
 	f = fopen(dest_name, "rb");
 	if (f) {
@@ -279,49 +89,27 @@ int write_atr(struct imd *imd, char *dest_name, int logical, int sio)
 		}
 	}
 
-	f = fopen(dest_name, "wb");
-	if (!f) {
-		fprintf(stderr,"Couldn't open %s\n", dest_name);
-		return 1;
-	}
-
-	if (logical && sec_size == 256 && size >= 768)
-		size -= 384;
+	layout = (logical ? ATR_LOGICAL : (sio ? ATR_SIO : ATR_PHYSICAL));
 
-	memset(header, 0, 16);
-	header[0] = 0x96;
-	header[1] = 0x02;
-	header[4] = sec_size;
-	header[5] = (sec_size >> 8);
-	header[2] = (size >> 4);
-	header[3] = (size >> 12);
-	header[6] = (size >> 20);
+	/* The image is built in memory and written with one call when it's closed */
+	img = image_create(dest_name, fmt, sec_size, src->nsects, layout);
+	if (!img)
+		return 1;
 
-	fwrite(header, 16, 1, f);
+	if (layout == ATR_PHYSICAL && fmt == &atr_format) {
+		/* Keep all 256 bytes of the first three sectors if we have them */
+		image_full_boot(src);
+		image_full_boot(img);
+	}
 
-	for (t = imd->tracks; t; t = t->next) {
-		int x;
-		for (x = 1; x != t->sects + 1; ++x) {
-			int y;
-			for (y = 0; y != t->sects; ++y)
-				if (t->map[y] == x)
-					break;
-			memcpy(buf, t->data + t->sec_size * y, t->sec_size);
-			for (y = 0; y != t->sec_size; ++y)
-				buf[y] ^= 0xFF;
-			if ((logical || sio) && sec_size == 256 && count < 3)
-				fwrite(buf, 128, 1, f);
-			else
-				fwrite(buf, t->sec_size, 1, f);
-			++count;
-			if (sio && count == 3) {
-				memset(buf, 0, 384);
-				fwrite(buf, 384, 1, f);
-			}
-		}
+	for (x = 1; x <= src->nsects; ++x) {
+		memset(buf, 0, sizeof(buf));
+		image_read(src, buf, x); /* Missing sectors are left as zeros */
+		image_write(img, buf, x);
 	}
 
-	fclose(f);
+	if (image_close(img))
+		return 1;
 	return 0;
 }
 
@@ -330,6 +118,7 @@ int main(int argc, char *argv[])
 	int dump = 0;
 	int logical = 1;
 	int sio = 0;
+	struct image_format *fmt = &atr_format;
 
 	int x;
 	int err = 0;
@@ -350,31 +139,46 @@ int main(int argc, char *argv[])
 			} else if (!strcmp(argv[x], "--physical")) {
 				sio = 0;
 				logical = 0;
-			} else
+			} else if (!strcmp(argv[x], "--dcm"))
+				fmt = &dcm_format;
+			else
 				err = 1;
 		} else {
 			char *source_name = argv[x];
 			char dest_name[1024];
-			struct imd *imd;
+			struct image *img;
 			char *p;
+			char *path;
+			char *arc;
 
 			/* Create destination name based on source name */
-			strcpy(dest_name, source_name);
+			if ((arc = zip_split(source_name, &path))) {
+				/* Put it in current directory if source is in a .zip archive */
+				if (strrchr(path, '/'))
+					path = strrchr(path, '/') + 1;
+				strcpy(dest_name, path);
+				free(arc);
+			} else
+				strcpy(dest_name, source_name);
+			dest_name[strlen(dest_name) - pack_ext_len(dest_name)] = 0; /* Drop .gz */
 			if ((p = strrchr(dest_name, '.')))
 				*p = 0;
-			strcat(dest_name, ".atr");
+			strcat(dest_name, ".");
+			strcat(dest_name, fmt->name);
 
-			/* Read imd file */
-			if (!(imd = read_imd(source_name)))
+			/* Read image file */
+			printf("Converting %s\n", source_name);
+			if (!(img = image_open(source_name, 1)))
 				return 1;
 
-			if (dump)
-				dump_imd(imd);
+			if (dump && img->imd)
+				dump_imd(img->imd);
 
-			/* Write atr file */
-			if (write_atr(imd, dest_name, logical, sio))
+			/* Write atr (or dcm) file */
+			if (write_atr(img, dest_name, fmt, logical, sio))
 				return 1;
 
+			image_close(img);
 			did = 1;
 		}
 	}
@@ -382,6 +186,7 @@ int main(int argc, char *argv[])
 	if (!did || err) {
 		fprintf(stderr,"Convert Dave Dunfield's .IMD (ImageDisk) file format to\n");
 		fprintf(stderr,"Nick Kennedy's .ATR (ATARI) disk image file format.\n");
+		fprintf(stderr,".XFD and .DCM images are also accepted.\n");
 		fprintf(stderr,"\n");
 		fprintf(stderr,"       version 1.0\n");
 		fprintf(stderr,"       by: Joe Allen (2011)\n");
@@ -389,6 +194,7 @@ int main(int argc, char *argv[])
 		fprintf(stderr,"imd2atr [options] filename\n");
 		fprintf(stderr,"\n");
 		fprintf(stderr,"  --dump    Show tracks\n");
+		fprintf(stderr,"  --dcm     Write DiskComm compressed .DCM file instead of .ATR\n");
 		fprintf(stderr,"\n");
 		fprintf(stderr,"The following options control how we deal with first three sectors of a 256-byte\n");
 		fprintf(stderr,"sector disk.  Such disks store 256 bytes on the disk for these sectors, but the\n");
@@ -0,0 +1,287 @@
+/*	Compressed image files
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "pack.h"
+
+static struct {
+	char *ext;
+	char *name;
+	int type;
+} packs[] = {
+	{ ".gz", "gzip", PACK_GZIP },
+	{ ".zst", "zstd", PACK_ZSTD },
+	{ 0, 0, 0 }
+};
+
+/* Find compression extension at end of name, returns index into packs or -1 */
+
+static int pack_find(char *name)
+{
+	int len = strlen(name);
+	int x;
+	for (x = 0; packs[x].ext; ++x) {
+		int l = strlen(packs[x].ext);
+		char *s = packs[x].ext;
+		char *t = name + len - l;
+		if (l >= len)
+			continue;
+		/* Case insensitive compare */
+		while (*s && (*t == *s || *t == *s - 'a' + 'A'))
+			++s, ++t;
+		if (!*s)
+			return x;
+	}
+	return -1;
+}
+
+int pack_ext_len(char *name)
+{
+	int x = pack_find(name);
+	return x == -1 ? 0 : strlen(packs[x].ext);
+}
+
+int pack_by_name(char *name)
+{
+	int x = pack_find(name);
+	return x == -1 ? PACK_NONE : packs[x].type;
+}
+
+static char *pack_name(int type)
+{
+	int x;
+	for (x = 0; packs[x].ext; ++x)
+		if (packs[x].type == type)
+			return packs[x].name;
+	return "unknown";
+}
+
+#ifdef HAVE_ZLIB
+
+/* Inflate a gzip file in one pass, growing the output as needed */
+
+static unsigned char *gunzip(unsigned char *raw, long size, long *len)
+{
+	z_stream z[1];
+	long alloc = size * 4 + 1024;
+	unsigned char *out = (unsigned char *)malloc(alloc);
+	int rtn;
+
+	memset(z, 0, sizeof(z));
+	if (!out || inflateInit2(z, 15 + 16) != Z_OK) {
+		free(out);
+		return 0;
+	}
+	z->next_in = raw;
+	z->avail_in = size;
+	z->next_out = out;
+	z->avail_out = alloc;
+	while ((rtn = inflate(z, Z_NO_FLUSH)) == Z_OK) {
+		if (!z->avail_out) {
+			unsigned char *n = (unsigned char *)realloc(out, alloc * 2);
+			if (!n)
+				break;
+			out = n;
+			z->next_out = out + alloc;
+			z->avail_out = alloc;
+			alloc *= 2;
+		} else if (!z->avail_in) {
+			/* Truncated */
+			break;
+		}
+	}
+	*len = z->total_out;
+	inflateEnd(z);
+	if (rtn != Z_STREAM_END) {
+		free(out);
+		return 0;
+	}
+	return out;
+}
+
+static unsigned char *gzip(unsigned char *raw, long size, long *len)
+{
+	z_stream z[1];
+	long alloc;
+	unsigned char *out;
+
+	memset(z, 0, sizeof(z));
+	if (deflateInit2(z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	alloc = deflateBound(z, size);
+	out = (unsigned char *)malloc(alloc);
+	z->next_in = raw;
+	z->avail_in = size;
+	z->next_out = out;
+	z->avail_out = alloc;
+	if (!out || deflate(z, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(z);
+		free(out);
+		return 0;
+	}
+	*len = z->total_out;
+	deflateEnd(z);
+	return out;
+}
+
+#endif
+
+#ifdef HAVE_ZSTD
+
+static unsigned char *unzstd(unsigned char *raw, long size, long *len)
+{
+	ZSTD_DStream *z = ZSTD_createDStream();
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer o;
+	long alloc = size * 4 + 1024;
+	unsigned char *out = (unsigned char *)malloc(alloc);
+	size_t rtn = 1;
+
+	if (!z || !out) {
+		free(out);
+		ZSTD_freeDStream(z);
+		return 0;
+	}
+	ZSTD_initDStream(z);
+	in.src = raw;
+	in.size = size;
+	in.pos = 0;
+	o.dst = out;
+	o.size = alloc;
+	o.pos = 0;
+	while (in.pos != in.size || o.pos == o.size) {
+		if (o.pos == o.size) {
+			unsigned char *n = (unsigned char *)realloc(out, alloc * 2);
+			if (!n)
+				break;
+			o.dst = out = n;
+			o.size = alloc = alloc * 2;
+		}
+		rtn = ZSTD_decompressStream(z, &o, &in);
+		if (ZSTD_isError(rtn))
+			break;
+	}
+	ZSTD_freeDStream(z);
+	/* rtn is 0 when a frame is completely decoded */
+	if (rtn) {
+		free(out);
+		return 0;
+	}
+	*len = o.pos;
+	return out;
+}
+
+static unsigned char *zstd(unsigned char *raw, long size, long *len)
+{
+	size_t alloc = ZSTD_compressBound(size);
+	unsigned char *out = (unsigned char *)malloc(alloc);
+	size_t rtn;
+	if (!out)
+		return 0;
+	rtn = ZSTD_compress(out, alloc, raw, size, 19);
+	if (ZSTD_isError(rtn)) {
+		free(out);
+		return 0;
+	}
+	*len = rtn;
+	return out;
+}
+
+#endif
+
+int pack_detect(unsigned char *p, long size)
+{
+	if (size >= 2 && p[0] == 0x1F && p[1] == 0x8B)
+		return PACK_GZIP;
+	else if (size >= 4 && p[0] == 0x28 && p[1] == 0xB5 && p[2] == 0x2F && p[3] == 0xFD)
+		return PACK_ZSTD;
+	else
+		return PACK_NONE;
+}
+
+int unpack(char *name, unsigned char **raw, long *size)
+{
+	unsigned char *p = *raw;
+	unsigned char *out = 0;
+	long len = 0;
+	int type = pack_detect(p, *size);
+
+	if (type == PACK_NONE)
+		return PACK_NONE;
+
+	switch (type) {
+#ifdef HAVE_ZLIB
+		case PACK_GZIP: {
+			out = gunzip(p, *size, &len);
+			break;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case PACK_ZSTD: {
+			out = unzstd(p, *size, &len);
+			break;
+		}
+#endif
+		default: {
+			fprintf(stderr, "'%s' is %s compressed, but %s support was not compiled in\n", name, pack_name(type), pack_name(type));
+			return -1;
+		}
+	}
+	if (!out) {
+		fprintf(stderr, "Couldn't decompress '%s'\n", name);
+		return -1;
+	}
+	free(*raw);
+	*raw = out;
+	*size = len;
+	return type;
+}
+
+unsigned char *pack(int type, unsigned char *raw, long size, long *len)
+{
+	unsigned char *out = 0;
+	switch (type) {
+#ifdef HAVE_ZLIB
+		case PACK_GZIP: {
+			out = gzip(raw, size, len);
+			break;
+		}
+#endif
+#ifdef HAVE_ZSTD
+		case PACK_ZSTD: {
+			out = zstd(raw, size, len);
+			break;
+		}
+#endif
+		default: {
+			fprintf(stderr, "%s support was not compiled in\n", pack_name(type));
+			return 0;
+		}
+	}
+	if (!out)
+		fprintf(stderr, "Couldn't %s compress image\n", pack_name(type));
+	return out;
+}
@@ -0,0 +1,48 @@
+/*	Compressed image files
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _Ipack
+#define _Ipack 1
+
+/* A whole image file may be compressed (like foo.atr.gz).  gzip needs zlib
+ * (compile with -DHAVE_ZLIB -lz) and zstd needs libzstd (-DHAVE_ZSTD
+ * -lzstd).
+ */
+
+#define PACK_NONE 0
+#define PACK_GZIP 1
+#define PACK_ZSTD 2
+
+/* Compression used for a file name from its extension, PACK_NONE if none */
+int pack_by_name(char *name);
+
+/* Length of the compression extension at end of name (like 3 for ".gz"), 0 if none */
+int pack_ext_len(char *name);
+
+/* Compression type from the first bytes of a file, PACK_NONE if none */
+int pack_detect(unsigned char *p, long size);
+
+/* Detect compression from the file contents and decompress in place: *raw
+   is replaced with a new malloc block if it was compressed.  Returns the
+   compression type or -1 for error. */
+int unpack(char *name, unsigned char **raw, long *size);
+
+/* Compress: returns malloc block or NULL for error */
+unsigned char *pack(int type, unsigned char *raw, long size, long *len);
+
+#endif
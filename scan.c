@@ -0,0 +1,402 @@
+/*	Read many files at once
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include "image.h"
+#include "scan.h"
+
+#define SCAN_IDLE 0 /* Not started */
+#define SCAN_BUSY 1 /* Read in flight */
+#define SCAN_DONE 2 /* Read complete, or failed if raw is NULL */
+
+struct scan_file {
+	int state;
+	int fd;
+	unsigned char *raw;
+	long size;
+	long done; /* Bytes read so far */
+	char *msg; /* Error message, printed when caller gets to this file */
+};
+
+struct scan {
+	char **names;
+	int n;
+	struct scan_file *files;
+	int depth;
+	int next; /* Next file to give to caller */
+	int started; /* Next file to start reading */
+	int busy; /* Number of files in SCAN_BUSY state */
+#ifdef HAVE_IO_URING
+	int ring; /* io_uring file descriptor, -1 if we don't have one */
+	int broken; /* Set if io_uring doesn't work after all: read() the rest */
+	int stuck; /* Set if we couldn't wait for reads in flight: their
+	              buffers can't be used or freed */
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+	int queued; /* Requests not yet submitted */
+	int inflight; /* Requests submitted, but not yet reaped */
+#endif
+};
+
+/* Open and lock file, get its size */
+
+static int open_file(struct scan *scan, int i)
+{
+	struct scan_file *f = scan->files + i;
+	struct stat st;
+#ifdef HAVE_FLOCK
+	f->fd = image_lock(scan->names[i], 0);
+	if (f->fd == -2)
+		return -1;
+#else
+	f->fd = open(scan->names[i], O_RDONLY);
+#endif
+	if (f->fd < 0) {
+		f->msg = "Couldn't open '%s'\n";
+		return -1;
+	}
+	if (fstat(f->fd, &st)) {
+		f->msg = "Couldn't get size of '%s'\n";
+		return -1;
+	}
+	f->size = st.st_size;
+	f->raw = (unsigned char *)malloc(f->size + 1);
+	if (!f->raw) {
+		f->msg = "Couldn't allocate space for '%s'\n";
+		return -1;
+	}
+	return 0;
+}
+
+/* File is done: release it.  If it failed, free its data. */
+
+static void finish_file(struct scan *scan, int i, int err)
+{
+	struct scan_file *f = scan->files + i;
+	if (f->fd >= 0)
+		close(f->fd);
+	f->fd = -1;
+	if (err && f->raw) {
+		free(f->raw);
+		f->raw = 0;
+	}
+	f->state = SCAN_DONE;
+}
+
+/* Read rest of file with read() */
+
+static void read_file(struct scan *scan, int i)
+{
+	struct scan_file *f = scan->files + i;
+	while (f->done != f->size) {
+		long len = pread(f->fd, f->raw + f->done, f->size - f->done, f->done);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			f->msg = "Couldn't read '%s'\n";
+			finish_file(scan, i, 1);
+			return;
+		}
+		if (!len) /* File got shorter */
+			f->size = f->done;
+		f->done += len;
+	}
+	finish_file(scan, i, 0);
+}
+
+#ifdef HAVE_IO_URING
+
+/* Set up io_uring with room for depth requests.  Returns non-zero if we
+   can't: then read() is used. */
+
+static int ring_setup(struct scan *scan)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	memset(&p, 0, sizeof(p));
+	scan->ring = syscall(__NR_io_uring_setup, scan->depth, &p);
+	if (scan->ring < 0)
+		return -1;
+	scan->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	scan->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	scan->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	scan->sq_map = mmap(0, scan->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, scan->ring, IORING_OFF_SQ_RING);
+	scan->cq_map = mmap(0, scan->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, scan->ring, IORING_OFF_CQ_RING);
+	scan->sqes = (struct io_uring_sqe *)mmap(0, scan->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, scan->ring, IORING_OFF_SQES);
+	if (scan->sq_map == MAP_FAILED || scan->cq_map == MAP_FAILED || scan->sqes == MAP_FAILED) {
+		if (scan->sq_map != MAP_FAILED)
+			munmap(scan->sq_map, scan->sq_len);
+		if (scan->cq_map != MAP_FAILED)
+			munmap(scan->cq_map, scan->cq_len);
+		if (scan->sqes != MAP_FAILED)
+			munmap(scan->sqes, scan->sqes_len);
+		close(scan->ring);
+		scan->ring = -1;
+		return -1;
+	}
+	sq = (unsigned char *)scan->sq_map;
+	cq = (unsigned char *)scan->cq_map;
+	scan->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	scan->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	scan->sq_array = (unsigned *)(sq + p.sq_off.array);
+	scan->cq_head = (unsigned *)(cq + p.cq_off.head);
+	scan->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	scan->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	scan->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void ring_free(struct scan *scan)
+{
+	if (scan->ring < 0)
+		return;
+	munmap(scan->sq_map, scan->sq_len);
+	munmap(scan->cq_map, scan->cq_len);
+	munmap(scan->sqes, scan->sqes_len);
+	close(scan->ring);
+	scan->ring = -1;
+}
+
+/* Queue read of rest of file: there is always room, since no more than
+   depth reads are ever in flight */
+
+static void ring_queue(struct scan *scan, int i)
+{
+	struct scan_file *f = scan->files + i;
+	unsigned tail = *scan->sq_tail;
+	unsigned idx = tail & *scan->sq_mask;
+	struct io_uring_sqe *sqe = scan->sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = f->fd;
+	sqe->addr = (unsigned long)(f->raw + f->done);
+	sqe->len = f->size - f->done;
+	sqe->off = f->done;
+	sqe->user_data = i;
+	scan->sq_array[idx] = idx;
+	__atomic_store_n(scan->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++scan->queued;
+}
+
+/* Submit queued reads, and wait for at least 'wait' of them to complete */
+
+static void ring_enter(struct scan *scan, int wait)
+{
+	for (;;) {
+		int n = syscall(__NR_io_uring_enter, scan->ring, scan->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n >= 0) {
+			scan->queued -= n;
+			scan->inflight += n;
+			if (!scan->queued || wait)
+				return;
+		} else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			/* Shouldn't happen: read() files from now on */
+			scan->broken = 1;
+			return;
+		}
+	}
+}
+
+/* Handle completed reads.  Once io_uring is broken, files which aren't
+   done are left busy: they're finished with read() when nothing is in
+   flight any more. */
+
+static void ring_reap(struct scan *scan)
+{
+	unsigned head = *scan->cq_head;
+	while (head != __atomic_load_n(scan->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = scan->cqes + (head & *scan->cq_mask);
+		int i = (int)cqe->user_data;
+		struct scan_file *f = scan->files + i;
+		int res = cqe->res;
+		++head;
+		__atomic_store_n(scan->cq_head, head, __ATOMIC_RELEASE);
+		--scan->inflight;
+		if (res < 0) {
+			/* Probably a kernel without IORING_OP_READ: use read()
+			   for this one and the rest */
+			scan->broken = 1;
+			continue;
+		}
+		if (!res) /* File got shorter */
+			f->size = f->done;
+		f->done += res;
+		if (f->done == f->size) {
+			finish_file(scan, i, 0);
+			--scan->busy;
+		} else if (!scan->broken) {
+			ring_queue(scan, i);
+		}
+	}
+}
+
+/* Wait for every submitted read to complete, so that no more are in
+   flight.  Closing the ring doesn't stop them: the kernel could write into
+   buffers we've given to the caller or freed. */
+
+static void ring_drain(struct scan *scan)
+{
+	while (scan->inflight && !scan->stuck) {
+		int n = syscall(__NR_io_uring_enter, scan->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			scan->stuck = 1;
+		else
+			ring_reap(scan);
+	}
+}
+
+/* Start reading more files, up to depth at a time */
+
+static void fill(struct scan *scan)
+{
+	if (scan->ring < 0 || scan->broken)
+		return;
+	while (scan->started != scan->n && scan->busy != scan->depth) {
+		int i = scan->started++;
+		if (open_file(scan, i)) {
+			finish_file(scan, i, 1);
+		} else if (!scan->files[i].size) {
+			finish_file(scan, i, 0);
+		} else {
+			scan->files[i].state = SCAN_BUSY;
+			ring_queue(scan, i);
+			++scan->busy;
+		}
+	}
+	if (scan->queued)
+		ring_enter(scan, 0);
+}
+
+#else
+
+#define fill(scan)
+
+#endif
+
+struct scan *scan_start(char **names, int n, int depth)
+{
+	struct scan *scan = (struct scan *)malloc(sizeof(struct scan));
+	int x;
+	memset(scan, 0, sizeof(struct scan));
+	scan->names = names;
+	scan->n = n;
+	scan->depth = depth;
+	scan->files = (struct scan_file *)calloc(n + 1, sizeof(struct scan_file));
+	for (x = 0; x != n; ++x)
+		scan->files[x].fd = -1;
+#ifdef HAVE_IO_URING
+	ring_setup(scan);
+#endif
+	fill(scan);
+	return scan;
+}
+
+int scan_next(struct scan *scan, unsigned char **raw, long *size)
+{
+	struct scan_file *f;
+	int i;
+	if (scan->next == scan->n)
+		return -1;
+	i = scan->next++;
+	f = scan->files + i;
+	fill(scan);
+#ifdef HAVE_IO_URING
+	while (f->state == SCAN_BUSY) {
+		if (scan->broken) {
+			ring_drain(scan);
+			if (f->state != SCAN_BUSY)
+				break;
+			if (scan->stuck) {
+				/* Leave buffer alone: the kernel may still write it */
+				f->msg = "Couldn't read '%s'\n";
+				f->raw = 0;
+				finish_file(scan, i, 1);
+			} else {
+				read_file(scan, i);
+			}
+			--scan->busy;
+		} else {
+			ring_enter(scan, 1);
+			ring_reap(scan);
+		}
+	}
+#endif
+	if (f->state == SCAN_IDLE) {
+		/* Not started: read it now */
+		if (open_file(scan, i))
+			finish_file(scan, i, 1);
+		else
+			read_file(scan, i);
+	}
+	/* Keep reads going while caller works on this one */
+	fill(scan);
+	*raw = f->raw;
+	*size = f->size;
+	f->raw = 0;
+	return i;
+}
+
+void scan_error(struct scan *scan, int i)
+{
+	if (scan->files[i].msg)
+		fprintf(stderr, scan->files[i].msg, scan->names[i]);
+}
+
+void scan_end(struct scan *scan)
+{
+	int x;
+#ifdef HAVE_IO_URING
+	/* Wait for reads still in flight: they point into our buffers */
+	while (scan->ring >= 0 && !scan->broken && scan->busy) {
+		ring_enter(scan, 1);
+		ring_reap(scan);
+	}
+	if (scan->ring >= 0)
+		ring_drain(scan);
+	ring_free(scan);
+#endif
+	for (x = 0; x != scan->n; ++x) {
+		if (scan->files[x].fd >= 0)
+			close(scan->files[x].fd);
+#ifdef HAVE_IO_URING
+		if (scan->stuck && scan->files[x].state == SCAN_BUSY)
+			continue;
+#endif
+		if (scan->files[x].raw)
+			free(scan->files[x].raw);
+	}
+	free(scan->files);
+	free(scan);
+}
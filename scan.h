@@ -0,0 +1,54 @@
+/*	Read many files at once
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+
+#ifndef _Iscan
+#define _Iscan 1
+
+/* Read a list of files into memory, keeping several reads going at once:
+ * with many small files, most of the time goes to waiting for each read,
+ * so the next ones are read while the caller works on the current one.
+ * With -DHAVE_IO_URING the reads are submitted together with io_uring,
+ * otherwise (or if the kernel doesn't have it) they are done one at a time
+ * with read().
+ *
+ * Each file is locked (shared, see image_open) while it's read.
+ */
+
+/* Default number of files being read at once */
+#define SCAN_DEPTH 32
+
+struct scan;
+
+/* Start reading names[0 .. n-1], up to depth at a time */
+struct scan *scan_start(char **names, int n, int depth);
+
+/* Wait for next file (in the order given), returns its index or -1 when
+   there are no more.  *raw is set to a malloc block with the file
+   contents, which now belongs to the caller, or NULL if the file couldn't
+   be read. */
+int scan_next(struct scan *scan, unsigned char **raw, long *size);
+
+/* Print why file i couldn't be read.  This is left to the caller so that
+   messages come out in order, even though files are read ahead. */
+void scan_error(struct scan *scan, int i);
+
+/* Finish: free everything */
+void scan_end(struct scan *scan);
+
+#endif
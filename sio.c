@@ -0,0 +1,185 @@
+/*	Drive and SIO bus timing model
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "imd.h"
+#include "sio.h"
+
+/* The numbers are approximate: adjust them to match real drives.
+ *
+ * overhead is set so that the stock interleave (consecutive sectors half a
+ * track apart) is the fastest gap at each drive's stock speed: an 810 or 1050
+ * just misses the sector 8 slots on and catches the one 9 slots on (13 on an
+ * enhanced density track).  The stock drives format every track the same
+ * way, so --best-skew still finds a few percent by skewing the tracks.  256
+ * byte sectors take longer than half a revolution to send at 19200 baud,
+ * which is why the XF551 sends them at 38400.
+ */
+
+struct drive drives[] = {
+	{ "810", "Atari 810", 288.0, 19200.0, 20.0, 10.0, 16.5, 3.0 },
+	{ "1050", "Atari 1050", 288.0, 19200.0, 20.0, 10.0, 16.5, 3.0 },
+	{ "1050-hs", "Atari 1050 with US Doubler or Happy high speed SIO", 288.0, 52400.0, 20.0, 10.0, 4.0, 3.0 },
+	{ "xf551", "Atari XF551", 300.0, 19200.0, 6.0, 10.0, 13.0, 3.0 },
+	{ "xf551-hs", "Atari XF551 high speed SIO", 300.0, 38400.0, 6.0, 10.0, 8.0, 3.0 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+struct drive *drive_by_name(char *name)
+{
+	int x;
+	for (x = 0; drives[x].name; ++x)
+		if (!strcmp(drives[x].name, name))
+			return drives + x;
+	return 0;
+}
+
+int sio_spt(int nsects)
+{
+	/* 1040 sector disks have 26 sectors per track, others have 18 */
+	return nsects > 720 ? 26 : 18;
+}
+
+int *sio_default_map(int sec_size, int nsects)
+{
+	if (sec_size == 256)
+		return hd_map;
+	else if (nsects > 720)
+		return dd_map;
+	else
+		return sd_map;
+}
+
+void sio_init(struct sio_sim *sim, struct drive *drive, int sec_size, int nsects, int *map)
+{
+	int x;
+	sim->drive = drive;
+	sim->sec_size = sec_size;
+	sim->spt = sio_spt(nsects);
+	if (!map)
+		map = sio_default_map(sec_size, nsects);
+	memset(sim->slot, 0, sizeof(sim->slot));
+	for (x = 0; x != sim->spt; ++x)
+		sim->slot[map[x]] = x;
+	sim->t = 0.0;
+	sim->track = 0;
+	sim->skew = 0;
+}
+
+/* Time to send bytes over the bus: 10 bits each */
+
+static double bus_time(struct sio_sim *sim, int bytes)
+{
+	return bytes * 10 * 1000.0 / sim->drive->baud;
+}
+
+void sio_read(struct sio_sim *sim, int sect)
+{
+	struct drive *d = sim->drive;
+	double rev = 60000.0 / d->rpm; /* One revolution */
+	double slot_time = rev / sim->spt; /* One sector passing under head */
+	int track = (sect - 1) / sim->spt;
+	int slot = (sim->slot[(sect - 1) % sim->spt + 1] + track * sim->skew) % sim->spt;
+	double wait;
+
+	/* Command frame, ACK */
+	sim->t += bus_time(sim, 5 + 1) + d->overhead;
+
+	/* Step to track */
+	if (track != sim->track) {
+		sim->t += abs(track - sim->track) * d->step + d->settle;
+		sim->track = track;
+	}
+
+	/* Wait for sector to come around, then read it */
+	wait = slot * slot_time - fmod(sim->t, rev);
+	if (wait < 0.0)
+		wait += rev;
+	sim->t += wait + slot_time;
+
+	/* COMPLETE, data frame, checksum: first three sectors of double density
+	   disks only send 128 bytes */
+	sim->t += bus_time(sim, 1 + (sim->sec_size == 256 && sect <= 3 ? 128 : sim->sec_size) + 1);
+
+	/* Computer gets ready for next one */
+	sim->t += d->host;
+}
+
+double sio_load_time(struct drive *drive, int sec_size, int nsects, int *map, int after, int *sects, int n)
+{
+	struct sio_sim sim[1];
+	double start;
+	int x;
+	sio_init(sim, drive, sec_size, nsects, map);
+	if (after)
+		sio_read(sim, after);
+	start = sim->t;
+	for (x = 0; x != n; ++x)
+		sio_read(sim, sects[x]);
+	return sim->t - start;
+}
+
+void sio_make_map(int *map, int spt, int gap)
+{
+	int used[256];
+	int pos = 0;
+	int x;
+	memset(used, 0, sizeof(used));
+	for (x = 1; x <= spt; ++x) {
+		/* Next free slot if it's taken */
+		while (used[pos])
+			pos = (pos + 1) % spt;
+		used[pos] = 1;
+		map[pos] = x;
+		pos = (pos + gap) % spt;
+	}
+}
+
+double sio_disk_time(struct drive *drive, int sec_size, int nsects, int *map, int skew)
+{
+	struct sio_sim sim[1];
+	int x;
+	sio_init(sim, drive, sec_size, nsects, map);
+	sim->skew = skew;
+	for (x = 1; x <= nsects; ++x)
+		sio_read(sim, x);
+	return sim->t;
+}
+
+double sio_best_map(struct drive *drive, int sec_size, int nsects, int *gap, int *skew)
+{
+	int spt = sio_spt(nsects);
+	int map[256];
+	double best = -1.0;
+	int g, k;
+	for (g = 1; g != spt; ++g) {
+		sio_make_map(map, spt, g);
+		for (k = 0; k != spt; ++k) {
+			double t = sio_disk_time(drive, sec_size, nsects, map, k);
+			if (best < 0.0 || t < best) {
+				best = t;
+				*gap = g;
+				*skew = k;
+			}
+		}
+	}
+	return best;
+}
@@ -0,0 +1,94 @@
+/*	Drive and SIO bus timing model
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _Isio
+#define _Isio 1
+
+/* Estimate how long a drive takes to read a list of sectors.  Each sector
+ * is one SIO transaction: the computer sends a command frame, the drive
+ * steps to the track if it has to, waits for the sector to come around,
+ * reads it, then sends it back over the bus.  The drive has no track
+ * buffer, so if the next sector has already passed by the time the
+ * computer asks for it, it waits for another revolution.  Where each
+ * sector is on its track comes from the interleave map.
+ *
+ * Times are in milliseconds.
+ */
+
+/* A drive */
+
+struct drive {
+	char *name;
+	char *desc;
+	double rpm; /* Rotation speed */
+	double baud; /* SIO bit rate */
+	double step; /* Time to step one track */
+	double settle; /* Head settle time after stepping */
+	double overhead; /* Bus delays and drive command processing per sector */
+	double host; /* Time computer takes between sectors */
+};
+
+/* Known drives, terminated with a NULL name */
+extern struct drive drives[];
+
+/* Find drive by name, returns NULL if not found */
+struct drive *drive_by_name(char *name);
+
+/* Simulation state */
+
+struct sio_sim {
+	struct drive *drive;
+	int sec_size; /* Bytes per sector */
+	int spt; /* Sectors per track */
+	int slot[256]; /* Position on track of each sector (1 - spt) */
+	int skew; /* Each track's map is rotated this many more slots than the
+	             previous track's.  0 after sio_init(). */
+	double t; /* Current time */
+	int track; /* Current head position */
+};
+
+/* Default interleave map for disk geometry */
+int *sio_default_map(int sec_size, int nsects);
+
+/* Sectors per track for disk geometry */
+int sio_spt(int nsects);
+
+/* Start simulation at time 0 with head on track 0.  map gives sector
+   numbers in the order they are on the track (like the .IMD sector map);
+   NULL for the default. */
+void sio_init(struct sio_sim *sim, struct drive *drive, int sec_size, int nsects, int *map);
+
+/* Read a sector: advances sim->t */
+void sio_read(struct sio_sim *sim, int sect);
+
+/* Time to read sects[0 .. n-1], after sector 'after' was just read (0 for
+   none) */
+double sio_load_time(struct drive *drive, int sec_size, int nsects, int *map, int after, int *sects, int n);
+
+/* Make an interleave map with consecutive sectors gap slots apart (the
+   standard maps have a gap of half the track) */
+void sio_make_map(int *map, int spt, int gap);
+
+/* Time to read the whole disk in sector order */
+double sio_disk_time(struct drive *drive, int sec_size, int nsects, int *map, int skew);
+
+/* Find the gap and skew which read the whole disk fastest on drive.
+   Returns the time. */
+double sio_best_map(struct drive *drive, int sec_size, int nsects, int *gap, int *skew);
+
+#endif
@@ -0,0 +1,277 @@
+/*	Read disk images out of .ZIP archives
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* A .ZIP archive ends with the end of central directory record:
+ *
+ *   0  "PK\5\6"
+ *   10 Number of entries (2 bytes)
+ *   12 Size of central directory (4 bytes)
+ *   16 Offset to central directory (4 bytes)
+ *   20 Comment length (2 bytes), then the comment
+ *
+ * The central directory has an entry for each member:
+ *
+ *   0  "PK\1\2"
+ *   8  Flags (bit 0 means encrypted)
+ *   10 Method: 0 = stored, 8 = deflated
+ *   16 CRC-32, compressed size and uncompressed size (4 bytes each)
+ *   28 Name, extra and comment lengths (2 bytes each)
+ *   42 Offset to local header (4 bytes)
+ *   46 Name, extra, comment
+ *
+ * Each member's data is preceded by a local header: "PK\3\4", with the name
+ * and extra lengths at 26 and 28 and the data following at 30 plus both
+ * lengths.  Multi-part and ZIP64 archives are not handled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "zip.h"
+
+/* Longest possible end record: header plus 64K comment */
+#define ZIP_END_MAX (22 + 65535)
+
+static unsigned get2(unsigned char *p)
+{
+	return p[0] + (p[1] << 8);
+}
+
+static unsigned long get4(unsigned char *p)
+{
+	return p[0] + (p[1] << 8) + ((unsigned long)p[2] << 16) + ((unsigned long)p[3] << 24);
+}
+
+void zip_close(struct zip *zip)
+{
+	struct zip_member *m;
+	while ((m = zip->members)) {
+		zip->members = m->next;
+		free(m->name);
+		free(m);
+	}
+	if (zip->f)
+		fclose(zip->f);
+	free(zip->name);
+	free(zip);
+}
+
+struct zip *zip_open(char *name)
+{
+	struct zip *zip;
+	struct zip_member **last;
+	unsigned char *buf;
+	unsigned char *p;
+	long len;
+	long got;
+	long x;
+	unsigned long cd_size, cd_offset;
+	unsigned n;
+
+	zip = (struct zip *)malloc(sizeof(struct zip));
+	memset(zip, 0, sizeof(struct zip));
+	zip->name = strdup(name);
+	last = &zip->members;
+
+	if (!(zip->f = fopen(name, "rb"))) {
+		fprintf(stderr, "Couldn't open '%s'\n", name);
+		zip_close(zip);
+		return 0;
+	}
+
+	/* Find end of central directory record */
+	if (fseek(zip->f, 0, SEEK_END) || (len = ftell(zip->f)) < 0) {
+		fprintf(stderr, "Couldn't get size of '%s'\n", name);
+		zip_close(zip);
+		return 0;
+	}
+	got = (len < ZIP_END_MAX ? len : ZIP_END_MAX);
+	buf = (unsigned char *)malloc(got + 1);
+	if (fseek(zip->f, len - got, SEEK_SET) || (got && 1 != fread(buf, got, 1, zip->f))) {
+		fprintf(stderr, "Couldn't read '%s'\n", name);
+		free(buf);
+		zip_close(zip);
+		return 0;
+	}
+	for (x = got - 22; x >= 0; --x)
+		if (!memcmp(buf + x, "PK\5\6", 4))
+			break;
+	if (x < 0) {
+		fprintf(stderr, "'%s' is not a .zip archive\n", name);
+		free(buf);
+		zip_close(zip);
+		return 0;
+	}
+	n = get2(buf + x + 10);
+	cd_size = get4(buf + x + 12);
+	cd_offset = get4(buf + x + 16);
+	free(buf);
+	if (n == 0xFFFF || cd_offset == 0xFFFFFFFFUL || (long)(cd_offset + cd_size) > len) {
+		fprintf(stderr, "'%s' is a ZIP64 or multi-part archive, which I can't read\n", name);
+		zip_close(zip);
+		return 0;
+	}
+
+	/* Read central directory */
+	buf = (unsigned char *)malloc(cd_size + 1);
+	if (fseek(zip->f, cd_offset, SEEK_SET) || (cd_size && 1 != fread(buf, cd_size, 1, zip->f))) {
+		fprintf(stderr, "Couldn't read central directory of '%s'\n", name);
+		free(buf);
+		zip_close(zip);
+		return 0;
+	}
+	for (p = buf; n--;) {
+		struct zip_member *m;
+		unsigned name_len;
+		if (p + 46 > buf + cd_size || memcmp(p, "PK\1\2", 4) ||
+		    p + 46 + get2(p + 28) + get2(p + 30) + get2(p + 32) > buf + cd_size) {
+			fprintf(stderr, "Bad central directory in '%s'\n", name);
+			free(buf);
+			zip_close(zip);
+			return 0;
+		}
+		name_len = get2(p + 28);
+		m = (struct zip_member *)malloc(sizeof(struct zip_member));
+		m->next = 0;
+		m->name = (char *)malloc(name_len + 1);
+		memcpy(m->name, p + 46, name_len);
+		m->name[name_len] = 0;
+		m->flags = get2(p + 8);
+		m->method = get2(p + 10);
+		m->crc = get4(p + 16);
+		m->csize = get4(p + 20);
+		m->usize = get4(p + 24);
+		m->offset = get4(p + 42);
+		*last = m;
+		last = &m->next;
+		++zip->nmembers;
+		p += 46 + name_len + get2(p + 30) + get2(p + 32);
+	}
+	free(buf);
+	return zip;
+}
+
+struct zip_member *zip_find(struct zip *zip, char *path)
+{
+	struct zip_member *m;
+	for (m = zip->members; m; m = m->next)
+		if (!strcmp(m->name, path))
+			return m;
+	return 0;
+}
+
+unsigned char *zip_read(struct zip *zip, struct zip_member *m, long *size)
+{
+	unsigned char hdr[30];
+	unsigned char *cdata;
+	unsigned char *out;
+
+	if (m->flags & 1) {
+		fprintf(stderr, "'%s:%s' is encrypted\n", zip->name, m->name);
+		return 0;
+	}
+	if (m->method != 0 && m->method != 8) {
+		fprintf(stderr, "'%s:%s' uses compression method %d, which I can't read\n", zip->name, m->name, m->method);
+		return 0;
+	}
+	if (fseek(zip->f, m->offset, SEEK_SET) || 1 != fread(hdr, 30, 1, zip->f) || memcmp(hdr, "PK\3\4", 4) ||
+	    fseek(zip->f, get2(hdr + 26) + get2(hdr + 28), SEEK_CUR)) {
+		fprintf(stderr, "Bad local header for '%s:%s'\n", zip->name, m->name);
+		return 0;
+	}
+	cdata = (unsigned char *)malloc(m->csize + 1);
+	if (m->csize && 1 != fread(cdata, m->csize, 1, zip->f)) {
+		fprintf(stderr, "Couldn't read '%s:%s'\n", zip->name, m->name);
+		free(cdata);
+		return 0;
+	}
+	if (m->method == 0) {
+		out = cdata;
+		*size = m->csize;
+	} else {
+#ifdef HAVE_ZLIB
+		z_stream z[1];
+		int rtn;
+		out = (unsigned char *)malloc(m->usize + 1);
+		memset(z, 0, sizeof(z));
+		z->next_in = cdata;
+		z->avail_in = m->csize;
+		z->next_out = out;
+		z->avail_out = m->usize;
+		/* Raw deflate, no zlib header */
+		if (inflateInit2(z, -15) != Z_OK) {
+			free(cdata);
+			free(out);
+			return 0;
+		}
+		rtn = inflate(z, Z_FINISH);
+		inflateEnd(z);
+		free(cdata);
+		if (rtn != Z_STREAM_END || z->total_out != m->usize) {
+			fprintf(stderr, "Couldn't inflate '%s:%s'\n", zip->name, m->name);
+			free(out);
+			return 0;
+		}
+		*size = m->usize;
+#else
+		fprintf(stderr, "'%s:%s' is deflated, but zlib support was not compiled in\n", zip->name, m->name);
+		free(cdata);
+		return 0;
+#endif
+	}
+#ifdef HAVE_ZLIB
+	if (crc32(crc32(0, Z_NULL, 0), out, *size) != m->crc) {
+		fprintf(stderr, "CRC error in '%s:%s'\n", zip->name, m->name);
+		free(out);
+		return 0;
+	}
+#endif
+	return out;
+}
+
+int zip_name(char *name)
+{
+	int len = strlen(name);
+	char *s = ".zip";
+	char *t = name + len - 4;
+	if (len <= 4)
+		return 0;
+	/* Case insensitive compare */
+	while (*s && (*t == *s || *t == *s - 'a' + 'A'))
+		++s, ++t;
+	return !*s;
+}
+
+char *zip_split(char *name, char **path)
+{
+	char *p;
+	for (p = name; (p = strchr(p, ':')); ++p) {
+		char *arc = (char *)malloc(p - name + 1);
+		memcpy(arc, name, p - name);
+		arc[p - name] = 0;
+		if (zip_name(arc)) {
+			*path = p + 1;
+			return arc;
+		}
+		free(arc);
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*	Read disk images out of .ZIP archives
+ *	Copyright
+ *		(C) 2011 Joseph H. Allen
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation; either version 1, or (at your option) any later version.
+ *
+ * It is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this software; see the file COPYING.  If not, write to the Free Software Foundation,
+ * 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _Izip
+#define _Izip 1
+
+/* Only the central directory is read when an archive is opened.  Members
+ * are found by seeking to them, so it doesn't matter how big the archive
+ * is.  Stored members can always be read, deflated members need zlib
+ * (compile with -DHAVE_ZLIB -lz).
+ */
+
+struct zip_member {
+	struct zip_member *next;
+	char *name; /* Path inside archive */
+	int method; /* 0 = stored, 8 = deflated */
+	int flags;
+	unsigned long crc;
+	unsigned long csize; /* Compressed size */
+	unsigned long usize; /* Uncompressed size */
+	unsigned long offset; /* Offset to local header */
+};
+
+struct zip {
+	char *name;
+	FILE *f;
+	struct zip_member *members; /* In central directory order */
+	int nmembers;
+};
+
+/* Open archive and read its central directory, returns NULL on error */
+struct zip *zip_open(char *name);
+
+/* Find a member by path, returns NULL if it's not there */
+struct zip_member *zip_find(struct zip *zip, char *path);
+
+/* Read and uncompress a member: returns malloc block or NULL on error */
+unsigned char *zip_read(struct zip *zip, struct zip_member *m, long *size);
+
+void zip_close(struct zip *zip);
+
+/* Split "archive.zip:path" into archive name and path.  Returns NULL if
+   name isn't like that, otherwise a malloc block holding the archive name,
+   and sets *path. */
+char *zip_split(char *name, char **path);
+
+/* True if name ends with .zip */
+int zip_name(char *name);
+
+#endif